@@ -0,0 +1,135 @@
+// Fragmentation over time: every thread runs sessions that allocate a group of objects together and
+// free them together when the session ends. Busy phases (many sessions) alternate with quiet ones,
+// after each phase the cache is shrunk and its slab count printed next to the live object count.
+// The second workload keeps a long lived population and runs bursts of short lived objects next to it,
+// a tenth of each burst outlives it until the next one. Long lived objects are replaced while the
+// burst slabs are nearly empty, a single partial list puts them there and pins those slabs.
+// Build once as is and once with -DPARTIAL_BUCKETS=1 (single partial list) to compare the two.
+#include <stdio.h>
+#include <stdlib.h>
+#include "slab.h"
+#include "test.h"
+
+#define BLOCK_NUMBER (2048)
+#define THREAD_NUM (4)
+#define SESSIONS (100) // per thread
+#define GROUP (40) // largest number of objects per session
+#define OBJECT_SIZE (64)
+#define PHASES (12)
+#define ITERATIONS (1000) // session changes per thread and phase
+#define LONG_LIVED (4000)
+#define BURST (300)
+#define REPLACED (60) // long lived objects replaced per burst
+#define BURSTS (200) // per phase
+
+struct session_s {
+	int size;
+	void* objs[GROUP];
+};
+
+struct session_s sessions[THREAD_NUM][SESSIONS];
+int active[THREAD_NUM];
+unsigned seeds[THREAD_NUM];
+int target = 0; // sessions per thread in the current phase
+
+unsigned next_rand(unsigned* seed) {
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+	return *seed;
+}
+
+void end_session(kmem_cache_t* cache, struct session_s* ses) {
+	for (int i = 0; i < ses->size; i++) kmem_cache_free(cache, ses->objs[i]);
+	ses->size = 0;
+}
+
+void start_session(kmem_cache_t* cache, struct session_s* ses, unsigned* seed) {
+	ses->size = 1 + next_rand(seed) % GROUP;
+	for (int i = 0; i < ses->size; i++) ses->objs[i] = kmem_cache_alloc(cache);
+}
+
+void churn(void* pdata) {
+	struct data_s data = *(struct data_s*)pdata;
+	struct session_s* mine = sessions[data.id - 1];
+	int* num = &active[data.id - 1];
+	unsigned* seed = &seeds[data.id - 1];
+	if (*seed == 0) *seed = 2463534242U * data.id;
+	for (int i = 0; i < data.iterations; i++) {
+		struct session_s* ses = &mine[next_rand(seed) % SESSIONS];
+		if (ses->size) { end_session(data.shared, ses); (*num)--; }
+		ses = &mine[next_rand(seed) % SESSIONS];
+		if (!ses->size && *num < target) { start_session(data.shared, ses, seed); (*num)++; }
+	}
+}
+
+void* long_lived[LONG_LIVED];
+void* burst[BURST];
+
+// long lived objects are freed while the burst is live and allocated again once it is mostly gone
+void run_bursts(kmem_cache_t* cache, unsigned* seed) {
+	int stragglers = 0;
+	for (int i = 0; i < BURSTS; i++) {
+		for (int j = stragglers; j < BURST; j++) burst[j] = kmem_cache_alloc(cache);
+		int replaced[REPLACED];
+		for (int j = 0; j < REPLACED; j++) {
+			replaced[j] = next_rand(seed) % LONG_LIVED;
+			if (long_lived[replaced[j]]) kmem_cache_free(cache, long_lived[replaced[j]]);
+			long_lived[replaced[j]] = 0;
+		}
+		int old = stragglers; // previous burst, the front of the array
+		for (int j = 0; j < old; j++) kmem_cache_free(cache, burst[j]);
+		stragglers = 0;
+		for (int j = old; j < BURST; j++) {
+			if (next_rand(seed) % 10) kmem_cache_free(cache, burst[j]);
+			else burst[stragglers++] = burst[j];
+		}
+		for (int j = 0; j < REPLACED; j++) {
+			if (!long_lived[replaced[j]]) long_lived[replaced[j]] = kmem_cache_alloc(cache);
+		}
+	}
+	for (int j = 0; j < stragglers; j++) kmem_cache_free(cache, burst[j]);
+}
+
+int main() {
+	void* space = malloc(BLOCK_SIZE * BLOCK_NUMBER);
+	kmem_init(space, BLOCK_NUMBER);
+	kmem_cache_t* cache = kmem_cache_create("churn", OBJECT_SIZE, 0, 0);
+
+	struct data_s data;
+	data.shared = cache;
+	data.iterations = ITERATIONS;
+	printf("phase   live  slabs\n");
+	for (int phase = 0; phase < PHASES; phase++) {
+		target = (phase % 2) ? SESSIONS / 5 : SESSIONS;
+		run_threads(churn, &data, THREAD_NUM);
+		kmem_cache_shrink(cache); // only slabs the phase emptied are released
+		int live = 0;
+		for (int t = 0; t < THREAD_NUM; t++) {
+			for (int i = 0; i < SESSIONS; i++) live += sessions[t][i].size;
+		}
+		printf("%5d %6d %6u\n", phase, live, kmem_cache_slabs(cache));
+	}
+	kmem_cache_info(cache);
+
+	for (int t = 0; t < THREAD_NUM; t++) {
+		for (int i = 0; i < SESSIONS; i++) end_session(cache, &sessions[t][i]);
+	}
+	kmem_cache_destroy(cache);
+
+	cache = kmem_cache_create("bursts", OBJECT_SIZE, 0, 0);
+	unsigned seed = 2463534242U;
+	for (int i = 0; i < LONG_LIVED; i++) long_lived[i] = kmem_cache_alloc(cache);
+	kmem_cache_shrink(cache);
+	printf("bursts  live  slabs\n");
+	printf("%6d %6d %6u\n", 0, LONG_LIVED, kmem_cache_slabs(cache));
+	for (int phase = 1; phase <= PHASES / 2; phase++) {
+		run_bursts(cache, &seed);
+		kmem_cache_shrink(cache); // bursts are over, a slab still held is pinned by long lived objects
+		printf("%6d %6d %6u\n", phase * BURSTS, LONG_LIVED, kmem_cache_slabs(cache));
+	}
+	for (int i = 0; i < LONG_LIVED; i++) kmem_cache_free(cache, long_lived[i]);
+	kmem_cache_destroy(cache);
+	free(space);
+	return 0;
+}
@@ -0,0 +1,95 @@
+// Node based containers with std::allocator and kmem::allocator, and new/delete against kmem::object_cache.
+// Every container is filled and emptied ROUNDS times, the time per inserted element is printed.
+#include "slab.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+#include <map>
+#include <memory>
+#include <unordered_map>
+
+#define BLOCK_NUMBER (2048)
+#define ELEMENTS (10000) // unordered_map bucket array has to stay below KMALLOC_MAX
+#define ROUNDS (50)
+
+struct node_s {
+    long key;
+    long value[4];
+    node_s(long k) : key(k) {}
+};
+
+typedef std::chrono::steady_clock bench_clock;
+
+double ns_per_op(bench_clock::time_point start, long ops) {
+    return std::chrono::duration<double, std::nano>(bench_clock::now() - start).count() / ops;
+}
+
+template <template <class> class Alloc>
+double bench_list() {
+    std::list<long, Alloc<long> > l;
+    bench_clock::time_point start = bench_clock::now();
+    for (int r = 0; r < ROUNDS; r++) {
+        for (long i = 0; i < ELEMENTS; i++) l.push_back(i);
+        while (!l.empty()) l.pop_front();
+    }
+    return ns_per_op(start, (long)ROUNDS * ELEMENTS);
+}
+
+template <template <class> class Alloc>
+double bench_map() {
+    std::map<long, long, std::less<long>, Alloc<std::pair<const long, long> > > m;
+    bench_clock::time_point start = bench_clock::now();
+    for (int r = 0; r < ROUNDS; r++) {
+        for (long i = 0; i < ELEMENTS; i++) m[(i * 7919) % ELEMENTS] = i;
+        for (long i = 0; i < ELEMENTS; i++) m.erase(i);
+    }
+    return ns_per_op(start, (long)ROUNDS * ELEMENTS);
+}
+
+template <template <class> class Alloc>
+double bench_unordered_map() {
+    std::unordered_map<long, long, std::hash<long>, std::equal_to<long>, Alloc<std::pair<const long, long> > > m;
+    bench_clock::time_point start = bench_clock::now();
+    for (int r = 0; r < ROUNDS; r++) {
+        for (long i = 0; i < ELEMENTS; i++) m[(i * 7919) % ELEMENTS] = i;
+        for (long i = 0; i < ELEMENTS; i++) m.erase(i);
+    }
+    return ns_per_op(start, (long)ROUNDS * ELEMENTS);
+}
+
+node_s* nodes[ELEMENTS];
+
+double bench_new() {
+    bench_clock::time_point start = bench_clock::now();
+    for (int r = 0; r < ROUNDS; r++) {
+        for (long i = 0; i < ELEMENTS; i++) nodes[i] = new node_s(i);
+        for (long i = 0; i < ELEMENTS; i++) delete nodes[i];
+    }
+    return ns_per_op(start, (long)ROUNDS * ELEMENTS);
+}
+
+double bench_object_cache() {
+    kmem::object_cache<node_s> cache("bench nodes");
+    bench_clock::time_point start = bench_clock::now();
+    for (int r = 0; r < ROUNDS; r++) {
+        for (long i = 0; i < ELEMENTS; i++) nodes[i] = cache.create(i);
+        for (long i = 0; i < ELEMENTS; i++) cache.destroy(nodes[i]);
+    }
+    return ns_per_op(start, (long)ROUNDS * ELEMENTS);
+}
+
+int main() {
+    void* space = std::malloc(BLOCK_SIZE * BLOCK_NUMBER);
+    kmem_init(space, BLOCK_NUMBER);
+
+    std::printf("ns per element   std::allocator  kmem::allocator\n");
+    std::printf("list             %14.1lf %16.1lf\n", bench_list<std::allocator>(), bench_list<kmem::allocator>());
+    std::printf("map              %14.1lf %16.1lf\n", bench_map<std::allocator>(), bench_map<kmem::allocator>());
+    std::printf("unordered_map    %14.1lf %16.1lf\n", bench_unordered_map<std::allocator>(), bench_unordered_map<kmem::allocator>());
+    std::printf("ns per object       new/delete  object_cache\n");
+    std::printf("node             %14.1lf %16.1lf\n", bench_new(), bench_object_cache());
+
+    std::free(space); // node caches of kmem::allocator live as long as the arena
+    return 0;
+}
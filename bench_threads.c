@@ -0,0 +1,61 @@
+// Cache line sharing between threads: every thread allocates and frees from its own cache, the caches are
+// created one after another so their descriptors are neighbours in the same cache block. Only the allocator
+// lock is shared on purpose. Build once as is and once with -DKMEM_PACKED_LAYOUT to compare the padded
+// layout with descriptors, slab headers and objects packed back to back.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+#include "slab.h"
+#include "test.h"
+
+#define BLOCK_NUMBER (2048)
+#define MAX_THREADS (8)
+#define OBJECT_SIZE (48)
+#define BATCH (64) // objects held at once, all of them from one slab most of the time
+#define ITERATIONS (20000) // batches per thread
+
+kmem_cache_t* caches[MAX_THREADS];
+
+void alloc_free(void* pdata) {
+	struct data_s data = *(struct data_s*)pdata;
+	kmem_cache_t* cache = caches[data.id - 1];
+	void* objs[BATCH];
+	void* keep = kmem_cache_alloc(cache); // slab never becomes empty, so it is not released and grown again
+	for (int i = 0; i < data.iterations; i++) {
+		for (int j = 0; j < BATCH; j++) {
+			objs[j] = kmem_cache_alloc(cache);
+			memset(objs[j], MASK, OBJECT_SIZE);
+		}
+		for (int j = 0; j < BATCH; j++) kmem_cache_free(cache, objs[j]);
+	}
+	kmem_cache_free(cache, keep);
+}
+
+int main() {
+	void* space = malloc(BLOCK_SIZE * BLOCK_NUMBER);
+	kmem_init(space, BLOCK_NUMBER);
+	for (int i = 0; i < MAX_THREADS; i++) {
+		char name[20];
+		sprintf_s(name, 20, "thread cache %d", i + 1);
+		caches[i] = kmem_cache_create(name, OBJECT_SIZE, 0, 0);
+	}
+
+	struct data_s data;
+	data.shared = 0;
+	data.iterations = ITERATIONS;
+	LARGE_INTEGER freq, start, end;
+	QueryPerformanceFrequency(&freq);
+	printf("threads  ns per alloc+free\n");
+	for (int num = 1; num <= MAX_THREADS; num <<= 1) {
+		QueryPerformanceCounter(&start);
+		run_threads(alloc_free, &data, num);
+		QueryPerformanceCounter(&end);
+		double ns = (end.QuadPart - start.QuadPart) * 1e9 / freq.QuadPart;
+		printf("%7d %19.1lf\n", num, ns / ((double)num * ITERATIONS * BATCH));
+	}
+
+	for (int i = 0; i < MAX_THREADS; i++) kmem_cache_destroy(caches[i]);
+	free(space);
+	return 0;
+}
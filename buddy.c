@@ -1,17 +1,27 @@
 #include "buddy.h"
 #include "utilities.h"
 #include <stdlib.h>
+#include <string.h>
 
 #define BLOCK_SIZE 4096
 #define BLOCK_NUM 256
-#define SIZE 12
+#define SIZE BUDDY_ORDERS
+#define PCP_NUM 16 // number of per-cpu lists of single blocks
+#define PCP_BATCH 8 // blocks moved between a per-cpu list and buddy_array at once
+#define PCP_HIGH 32 // per-cpu list is drained by PCP_BATCH when it grows above this
 
 typedef struct buddy_elem {
     struct buddy_elem*  next;
 } buddyElem;
 
+typedef struct pcp_list {
+    struct buddy_elem* head;
+    unsigned count;
+} pcpList;
+
 typedef struct buddy_allocator {
     struct buddy_elem* buddy_array[SIZE];
+    pcpList pcp[PCP_NUM];
     unsigned size;
     unsigned block_num;
     unsigned available_blocks;
@@ -26,6 +36,10 @@ void init_bud(void* space, unsigned block_num) {
     b.block_num = block_num;
     b.size = pos(block_num) + 1;
     b.available_blocks = block_num;
+    for (unsigned i = 0; i < PCP_NUM; i++) {
+        b.pcp[i].head = 0;
+        b.pcp[i].count = 0;
+    }
     // initialize buddy_array
     unsigned mask = 1U;
     void* next_block_addr = space;
@@ -33,7 +47,7 @@ void init_bud(void* space, unsigned block_num) {
         if(mask & block_num) {
             b.buddy_array[i] = next_block_addr;
             *(buddyElem**)(next_block_addr) = 0;
-            next_block_addr =(void*)((unsigned long)next_block_addr + (1 << (i + 12)));
+            next_block_addr =(void*)((unsigned long)next_block_addr + ((unsigned long)BLOCK_SIZE << i));
         } else {
             b.buddy_array[i] = 0;
         } 
@@ -52,6 +66,9 @@ void print_arr() {
             printf("\n");
         }
     }
+    for (unsigned i = 0; i < PCP_NUM; i++) {
+        if (b.pcp[i].count) printf("cpu %d: %d blocks\n", i, b.pcp[i].count);
+    }
 }
 
 // first available chunk that we find is realocated to arr[i-1] with shift of block_num
@@ -79,7 +96,7 @@ void* split(unsigned start_index, unsigned curr_index) {
 void* alloc(unsigned block_num) {
     if (b.available_blocks < block_num) return 0;
     int index = power_of_two(block_num);
-    if (index == -1 || b.available_blocks < block_num) return 0;
+    if (index == -1 || index >= (int)b.size || b.available_blocks < block_num) return 0;
     void* addr = 0;
     if (b.buddy_array[index]) {
         addr = b.buddy_array[index];
@@ -93,16 +110,12 @@ void* alloc(unsigned block_num) {
 
 // returns number of a pair for a given block_size
 unsigned long get_pair(unsigned long addr, unsigned block_size) {
-    unsigned long startAddr = (unsigned long)b.start_addr;
-    unsigned long currAddr = startAddr;
-    unsigned capacity =  1 << (b.size - 1);
-    unsigned offset = 2*block_size;
-    while (currAddr < startAddr + capacity*BLOCK_SIZE){
-        if ((unsigned long)addr == currAddr) return currAddr + block_size*BLOCK_SIZE;
-        else if ((unsigned long)addr == currAddr + block_size*BLOCK_SIZE) return currAddr;
-        currAddr += offset*BLOCK_SIZE;
-    }
-    return 0;
+    unsigned long offset = addr - (unsigned long)b.start_addr;
+    unsigned long chunk = (unsigned long)block_size*BLOCK_SIZE;
+    unsigned long capacity = (1UL << (b.size - 1))*BLOCK_SIZE;
+    // lower buddy of the pair has to lie inside the largest power of two the allocator manages
+    if (offset % chunk || (offset & ~chunk) >= capacity) return 0;
+    return (unsigned long)b.start_addr + (offset ^ chunk);
 }
 
 // checks if given address is in the list of b.buddy_array[index]; return pointer to prev element
@@ -120,8 +133,8 @@ int long pairInList(unsigned long pair, int index) {
 
 void merge(void* addr, int index) {
     unsigned long pair = get_pair((unsigned long)addr, 1 << index);
-    if (pair == 0) { printf("Error: no pair.\n"); exit(-1); }
-    long int ret = pairInList(pair, index);
+    // chunks past the largest power of two of an arena that is not one have no buddy, they stay as they are
+    long int ret = pair ? pairInList(pair, index) : -1;
     if (ret == -1 || index == b.size - 1) { // no pair in list or last level
         *(buddyElem**)addr = b.buddy_array[index];
         b.buddy_array[index] = (buddyElem*)addr;
@@ -150,4 +163,115 @@ void dealloc(void* addr, unsigned block_size) {
     b.available_blocks += block_size;
 }
 
+// takes PCP_BATCH blocks from buddy_array, one split if there is a large enough chunk
+void refill_pages(pcpList* l) {
+    buddyElem* chunk = (buddyElem*)alloc(PCP_BATCH);
+    for (unsigned i = 0; i < PCP_BATCH; i++) {
+        buddyElem* page = 0;
+        if (chunk) page = (buddyElem*)((unsigned long)chunk + i*BLOCK_SIZE);
+        else page = (buddyElem*)alloc(1);
+        if (!page) break;
+        page->next = l->head;
+        l->head = page;
+        l->count++;
+    }
+}
+
+void drain_list(pcpList* l, unsigned num) {
+    while (l->head && num--) {
+        buddyElem* page = l->head;
+        l->head = page->next;
+        l->count--;
+        dealloc(page, 1);
+    }
+}
+
+void* alloc_page(unsigned cpu) {
+    pcpList* l = &b.pcp[cpu % PCP_NUM];
+    if (!l->head) refill_pages(l);
+    if (!l->head) return 0;
+    buddyElem* page = l->head;
+    l->head = page->next;
+    l->count--;
+    return page;
+}
+
+void dealloc_page(void* addr, unsigned cpu) {
+    if (addr == 0 || addr < b.start_addr || addr >= (void*)((unsigned long)b.start_addr + (b.block_num)*BLOCK_SIZE)) return;
+    pcpList* l = &b.pcp[cpu % PCP_NUM];
+    ((buddyElem*)addr)->next = l->head;
+    l->head = (buddyElem*)addr;
+    l->count++;
+    if (l->count > PCP_HIGH) drain_list(l, PCP_BATCH);
+}
+
+unsigned drain_pages() {
+    unsigned num = 0;
+    for (unsigned i = 0; i < PCP_NUM; i++) {
+        num += b.pcp[i].count;
+        drain_list(&b.pcp[i], b.pcp[i].count);
+    }
+    return num;
+}
+
+unsigned char free_map[(1U << (SIZE - 1)) / 8]; // bit per block, set for free blocks
 
+void mark_free(unsigned long first, unsigned long num) {
+    for (unsigned long i = first; i < first + num; i++) free_map[i / 8] |= 1 << (i % 8);
+}
+
+// one pass over the arena in address order
+unsigned longest_run() {
+    unsigned largest = 0;
+    unsigned run = 0;
+    for (unsigned i = 0; i < b.block_num; i++) {
+        if (free_map[i / 8] & (1 << (i % 8))) {
+            if (++run > largest) largest = run;
+        } else {
+            run = 0;
+        }
+    }
+    return largest;
+}
+
+void buddy_snapshot(buddyInfo* info) {
+    info->block_num = b.block_num;
+    info->free_blocks = 0;
+    info->pcp_blocks = drain_pages();
+    info->largest_order = -1;
+    memset(free_map, 0, (b.block_num + 7) / 8);
+    for (unsigned i = 0; i < SIZE; i++) {
+        info->free_count[i] = 0;
+        if (i >= b.size) continue;
+        for (buddyElem* curr = b.buddy_array[i]; curr; curr = curr->next) {
+            info->free_count[i]++;
+            mark_free(((unsigned long)curr - (unsigned long)b.start_addr) / BLOCK_SIZE, 1UL << i);
+        }
+        info->free_blocks += info->free_count[i] << i;
+        if (info->free_count[i]) info->largest_order = i;
+    }
+    info->largest_run = longest_run();
+}
+
+int fragmentation_index(const buddyInfo* info, unsigned order) {
+    if (info->largest_order >= (int)order) return -1000;
+    unsigned chunks = 0;
+    for (unsigned i = 0; i < SIZE; i++) chunks += info->free_count[i];
+    if (chunks == 0) return 0;
+    // same formula as Linux: 1 - (1 + free / requested) / chunks
+    unsigned long requested = 1UL << order;
+    return (int)(1000 - (1000 + info->free_blocks * 1000UL / requested) / chunks);
+}
+
+void print_free_area() {
+    buddyInfo info;
+    buddy_snapshot(&info);
+    printf("--- free area ---\n");
+    printf("blocks: %u free: %u drained from per-cpu: %u\n", info.block_num, info.free_blocks, info.pcp_blocks);
+    printf("largest free run: %u blocks\n", info.largest_run);
+    printf("order  free  fragm\n");
+    for (unsigned i = 0; i < b.size; i++) {
+        printf("%5u %5u %6d\n", i, info.free_count[i], fragmentation_index(&info, i));
+    }
+    printf("-----------------\n");
+}
@@ -1,6 +1,17 @@
 #ifndef _BUDDY_H_
 #define _BUDDY_H_
 
+#define BUDDY_ORDERS 20 // arena of up to 2^19 blocks, 2GB
+
+typedef struct buddy_info {
+    unsigned block_num; // blocks managed by the allocator
+    unsigned free_blocks; // blocks in buddy lists
+    unsigned pcp_blocks; // blocks drained from per-cpu lists for the snapshot, included in free_blocks
+    unsigned free_count[BUDDY_ORDERS]; // free chunks of 2^i blocks
+    int largest_order; // order of the largest free chunk, -1 if there is none
+    unsigned largest_run; // longest run of free blocks, adjacent chunks that are not buddies included
+} buddyInfo;
+
 // initializes array of pointers to available blocks and other elements of a buddyAllocator structure
 void print_arr();
 
@@ -11,4 +22,24 @@ void* alloc(unsigned block_num);
 // deallocate and merge if there is a pair 
 void dealloc(void* addr, unsigned block_size);
 
+// single blocks are served from per-cpu lists that are refilled and drained in batches;
+// lists are not locked, caller serializes access to them like for the rest of the allocator
+void* alloc_page(unsigned cpu);
+
+void dealloc_page(void* addr, unsigned cpu);
+
+// return blocks cached in per-cpu lists to the buddy lists, returns number of blocks
+unsigned drain_pages();
+
+// snapshot of free lists, per-cpu lists are drained first so their blocks are counted in the chunks
+// they merge into; one pass over free chunks and one over a bitmap of the arena
+void buddy_snapshot(buddyInfo* info);
+
+// external fragmentation index for a request of 2^order blocks, in thousandths;
+// -1000 if request would succeed, towards 0 lack of memory, towards 1000 fragmentation
+int fragmentation_index(const buddyInfo* info, unsigned order);
+
+// prints free area report: chunks per order, largest run and fragmentation index per order
+void print_free_area();
+
 #endif
\ No newline at end of file
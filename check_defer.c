@@ -0,0 +1,191 @@
+// Deferred free checks, every case prints ok or asserts.
+// readers: readers walk a table while writers replace its entries and defer the free of the old ones,
+//          a destructor clears the magic of freed nodes and every allocation gets a new value, so a reader
+//          can tell it saw a freed or reused node
+// wrap:    retire and poll with the epoch started next to 2^31, 2^32 and 2^33
+// destroy: a cache destroyed with a free still pending, its descriptor and slab go to the next cache
+// defrag:  objects of sparse slabs are moved, one of them has a free pending and must stay where it is
+// full:    retire inside a read-side section with the arena full, object is handed back and freed later
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <windows.h>
+#include "slab.h"
+#include "defer.h"
+#include "test.h"
+
+#define BLOCK_NUMBER (2048)
+#define OBJECT_SIZE (64)
+#define SLOTS (64)
+#define WRITERS (2)
+#define READERS (3)
+#define ITERATIONS (100000) // replaced nodes per writer
+#define MAGIC (0x1234)
+#define READ_SPIN (200)
+#define DEFRAG_OBJECTS (4096)
+
+struct node_s {
+	long magic;
+	long value;
+};
+
+struct node_s* volatile slots[SLOTS];
+volatile LONG writers_done = 0;
+volatile LONG bad_reads = 0;
+volatile LONG next_value = 0; // every node gets its own value, a reused node changes it
+
+void clear_magic(void* node) {
+	((struct node_s*)node)->magic = 0;
+}
+
+void reader(void) {
+	while (writers_done < WRITERS) {
+		int token = kmem_read_lock();
+		for (int i = 0; i < SLOTS; i++) {
+			struct node_s* node = slots[i];
+			long value = node->value;
+			for (volatile int spin = 0; spin < READ_SPIN; spin++); // writers get to retire node meanwhile
+			if (node->magic != MAGIC || node->value != value) InterlockedIncrement(&bad_reads); // freed or reused
+		}
+		kmem_read_unlock(token);
+	}
+}
+
+void writer(kmem_cache_t* cache, int id, int iterations) {
+	unsigned seed = id;
+	for (int i = 0; i < iterations; i++) {
+		seed = seed * 1103515245 + 12345;
+		struct node_s* node = kmem_cache_alloc(cache);
+		assert(node);
+		node->magic = MAGIC;
+		node->value = InterlockedIncrement(&next_value);
+		struct node_s* old = InterlockedExchangePointer((void* volatile*)&slots[(seed >> 8) % SLOTS], node);
+		while (kmem_cache_free_deferred(cache, old) < 0) kmem_defer_barrier(); // not a reader, may wait
+	}
+	InterlockedIncrement(&writers_done);
+}
+
+void reader_writer(void* pdata) {
+	struct data_s data = *(struct data_s*)pdata;
+	if (data.id <= WRITERS) writer(data.shared, data.id, data.iterations);
+	else reader();
+}
+
+void check_readers() {
+	kmem_cache_t* cache = kmem_cache_create("defer nodes", sizeof(struct node_s), 0, clear_magic);
+	for (int i = 0; i < SLOTS; i++) {
+		slots[i] = kmem_cache_alloc(cache);
+		slots[i]->magic = MAGIC;
+	}
+	struct data_s data;
+	data.shared = cache;
+	data.iterations = ITERATIONS;
+	run_threads(reader_writer, &data, WRITERS + READERS);
+	kmem_defer_barrier();
+	assert(bad_reads == 0);
+	for (int i = 0; i < SLOTS; i++) kmem_cache_free(cache, slots[i]);
+	kmem_cache_shrink(cache);
+	assert(kmem_cache_slabs(cache) == 0);
+	printf("readers: %d replaced nodes, no freed node seen, ok\n", WRITERS * ITERATIONS);
+	kmem_cache_destroy(cache);
+}
+
+void check_wrap() {
+	kmem_cache_t* cache = kmem_cache_create("defer wrap", OBJECT_SIZE, 0, 0);
+	for (long long base = 0x7FFFFFF0LL; base < 0x200000000LL; base <<= 1) {
+		defer_set_epoch(base);
+		for (int r = 0; r < 200; r++) {
+			for (int i = 0; i < 100; i++) assert(kmem_cache_free_deferred(cache, kmem_cache_alloc(cache)) == 0);
+			kmem_defer_poll();
+		}
+		kmem_defer_barrier();
+		kmem_cache_shrink(cache);
+		assert(kmem_cache_slabs(cache) == 0); // everything retired was freed
+	}
+	printf("wrap: ok\n");
+	kmem_cache_destroy(cache);
+}
+
+void check_destroy() {
+	kmem_cache_t* a = kmem_cache_create("defer a", OBJECT_SIZE, 0, 0);
+	void* x = kmem_cache_alloc(a);
+	kmem_cache_free_deferred(a, x);
+	kmem_cache_destroy(a);
+
+	kmem_cache_t* b = kmem_cache_create("defer b", OBJECT_SIZE, 0, 0);
+	void* y0 = kmem_cache_alloc(b);
+	kmem_defer_barrier(); // must not free x, y0 may be at the same address
+	void* y1 = kmem_cache_alloc(b);
+	assert(y0 != y1);
+	printf("destroy: %s descriptor, %s address, ok\n", a == b ? "same" : "other", x == y0 ? "same" : "other");
+	kmem_cache_free(b, y0);
+	kmem_cache_free(b, y1);
+	kmem_cache_destroy(b);
+}
+
+void* defrag_objs[DEFRAG_OBJECTS];
+void* retired_obj;
+int retired_moved = 0;
+
+int isolate_any(void* obj) {
+	return 1;
+}
+
+void migrate_table(void* from, void* to) {
+	if (from == retired_obj) retired_moved = 1;
+	for (int i = 0; i < DEFRAG_OBJECTS; i++) {
+		if (defrag_objs[i] == from) defrag_objs[i] = to;
+	}
+}
+
+void check_defrag() {
+	kmem_cache_t* cache = kmem_cache_create("defer defrag", OBJECT_SIZE, 0, 0);
+	kmem_cache_set_relocate(cache, isolate_any, migrate_table);
+	for (int i = 0; i < DEFRAG_OBJECTS; i++) defrag_objs[i] = kmem_cache_alloc(cache);
+	for (int i = 0; i < DEFRAG_OBJECTS; i++) {
+		if (i % 8) { kmem_cache_free(cache, defrag_objs[i]); defrag_objs[i] = 0; } // every slab sparse
+	}
+	retired_obj = defrag_objs[8];
+	defrag_objs[8] = 0;
+	kmem_cache_free_deferred(cache, retired_obj);
+	unsigned before = kmem_cache_slabs(cache);
+	int released = kmem_cache_defrag(cache);
+	assert(released > 0 && !retired_moved);
+	kmem_defer_barrier();
+	for (int i = 0; i < DEFRAG_OBJECTS; i++) kmem_cache_free(cache, defrag_objs[i]);
+	kmem_cache_shrink(cache);
+	assert(kmem_cache_slabs(cache) == 0);
+	printf("defrag: %u slabs, %d blocks released, retired object not moved, ok\n", before, released);
+	kmem_cache_destroy(cache);
+}
+
+void check_full() {
+	kmem_cache_t* cache = kmem_cache_create("defer full", OBJECT_SIZE, 0, 0);
+	void** objs = (void**)malloc(sizeof(void*) * BLOCK_NUMBER * (BLOCK_SIZE / OBJECT_SIZE));
+	int num = 0;
+	while ((objs[num] = kmem_cache_alloc(cache))) num++;
+	int token = kmem_read_lock(); // epoch advances at most once, retired records stay in use
+	int queued = 0;
+	while (queued < num && kmem_cache_free_deferred(cache, objs[queued]) == 0) queued++;
+	kmem_read_unlock(token);
+	assert(queued < num);
+	kmem_defer_barrier();
+	for (int i = queued; i < num; i++) kmem_cache_free(cache, objs[i]); // objs[queued] was handed back
+	kmem_cache_shrink(cache);
+	assert(kmem_cache_slabs(cache) == 0);
+	printf("full: %d of %d objects queued, ok\n", queued, num);
+	free(objs);
+	kmem_cache_destroy(cache);
+}
+
+int main() {
+	void* space = malloc(BLOCK_SIZE * BLOCK_NUMBER);
+	kmem_init(space, BLOCK_NUMBER);
+	check_readers();
+	check_wrap();
+	check_destroy();
+	check_defrag();
+	check_full();
+	free(space);
+	return 0;
+}
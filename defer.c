@@ -0,0 +1,230 @@
+#include "defer.h"
+#include "slab.h"
+#include <windows.h>
+#include <stdio.h>
+
+#define DEFER_BATCH 62 // objects per batch record, record fits 1KB
+#define DEFER_POLL 4 // full batches waiting in current epoch before writer tries to advance
+#define DEFER_RESERVE (3 * (DEFER_POLL + 1)) // batch records kept from shrink, enough for all three epochs
+#define DEFER_SPARE 4 // static batch records for when batch_cache runs out of memory
+
+// Retired objects are tagged with the epoch they were retired in. Readers count themselves
+// in readers[epoch & 1]; epoch e may become e + 1 only when no reader of parity e + 1 is left.
+// Any reader active at retire time is waited for by one of the next two advances,
+// so objects retired in epoch r are freed when epoch reaches r + 2.
+
+typedef struct defer_item {
+    kmem_cache_t* cachep; // 0 for kmalloc buffers
+    void* obj;
+} deferItem;
+
+typedef struct defer_batch {
+    struct defer_batch* next;
+    unsigned num;
+    deferItem items[DEFER_BATCH];
+} deferBatch;
+
+typedef struct defer_state {
+    CRITICAL_SECTION lock; // protects everything but readers and epoch
+    volatile LONG64 epoch; // 64 bits never wrap, a 32 bit counter would not wrap at a multiple of 3
+    volatile LONG readers[2];
+    deferBatch* retired[3]; // by epoch % 3
+    unsigned batches[3];
+    kmem_cache_t* batch_cache;
+    deferBatch* spare; // unused records of spare_batches
+} deferState;
+
+deferState d;
+deferBatch spare_batches[DEFER_SPARE];
+
+void defer_init() {
+    if (!InitializeCriticalSectionAndSpinCount(&d.lock, 0x00000400)) {
+        printf("Error: initializing critical section.\n"); exit(-1);
+    }
+    d.epoch = 0;
+    d.readers[0] = 0; d.readers[1] = 0;
+    for (int i = 0; i < 3; i++) {
+        d.retired[i] = 0;
+        d.batches[i] = 0;
+    }
+    d.batch_cache = 0;
+    d.spare = 0;
+    for (int i = 0; i < DEFER_SPARE; i++) {
+        spare_batches[i].next = d.spare;
+        d.spare = &spare_batches[i];
+    }
+}
+
+void defer_set_epoch(long long epoch) {
+    EnterCriticalSection(&d.lock);
+    d.epoch = epoch;
+    LeaveCriticalSection(&d.lock);
+}
+
+int kmem_read_lock() {
+    int token = (int)(d.epoch & 1);
+    InterlockedIncrement(&d.readers[token]); // full barrier, reads below cannot move above it
+    return token;
+} // Enter read-side section, returns token for kmem_read_unlock
+
+void kmem_read_unlock(int token) {
+    InterlockedDecrement(&d.readers[token]);
+} // Leave read-side section
+
+int cmp_items(const void* a, const void* b) {
+    const deferItem* x = (const deferItem*)a;
+    const deferItem* y = (const deferItem*)b;
+    if (x->cachep != y->cachep) return x->cachep < y->cachep ? -1 : 1;
+    if (x->obj != y->obj) return x->obj < y->obj ? -1 : 1;
+    return 0;
+}
+
+// batch record from batch_cache, or a spare one when memory is short; caller holds d.lock
+deferBatch* new_batch() {
+    if (!d.batch_cache && !d.spare) { // created once spare records run out, so an idle program pays nothing
+        d.batch_cache = kmem_cache_create("deferred frees", sizeof(deferBatch), 0, 0);
+        if (d.batch_cache) kmem_cache_reserve(d.batch_cache, DEFER_RESERVE);
+    }
+    deferBatch* batch = d.batch_cache ? kmem_cache_alloc(d.batch_cache) : 0;
+    if (!batch && d.spare) {
+        batch = d.spare;
+        d.spare = batch->next;
+    }
+    return batch;
+}
+
+void release_batch(deferBatch* batch) {
+    if (batch >= spare_batches && batch < spare_batches + DEFER_SPARE) {
+        EnterCriticalSection(&d.lock);
+        batch->next = d.spare;
+        d.spare = batch;
+        LeaveCriticalSection(&d.lock);
+    } else {
+        kmem_cache_free(d.batch_cache, batch);
+    }
+}
+
+// frees batches, objects are sorted so every slab is visited once per batch
+int free_batches(deferBatch* batch) {
+    int freed = 0;
+    void* objs[DEFER_BATCH];
+    while (batch) {
+        deferBatch* next = batch->next;
+        qsort(batch->items, batch->num, sizeof(deferItem), cmp_items);
+        for (unsigned i = 0; i < batch->num; ) {
+            unsigned n = 0;
+            kmem_cache_t* cachep = batch->items[i].cachep;
+            for (; i < batch->num && batch->items[i].cachep == cachep; i++) objs[n++] = batch->items[i].obj;
+            if (cachep) kmem_cache_free_bulk(cachep, objs, n);
+            else kfree_bulk(objs, n);
+            freed += n;
+        }
+        release_batch(batch);
+        batch = next;
+    }
+    return freed;
+}
+
+// moves to next epoch if readers allow it, returns batches that became safe to free
+deferBatch* try_advance() {
+    unsigned long long e = d.epoch;
+    if (d.readers[(e + 1) & 1]) return 0;
+    deferBatch* safe = d.retired[(e + 2) % 3]; // retired in e - 1
+    d.retired[(e + 2) % 3] = 0;
+    d.batches[(e + 2) % 3] = 0;
+    InterlockedIncrement64(&d.epoch);
+    return safe;
+}
+
+// returns -1 if objp could not be queued
+int retire(kmem_cache_t* cachep, void* objp) {
+    if (objp == 0) return 0;
+    EnterCriticalSection(&d.lock);
+    int slot = (int)((unsigned long long)d.epoch % 3);
+    deferBatch* batch = d.retired[slot];
+    if (!batch || batch->num == DEFER_BATCH) {
+        batch = new_batch();
+        if (!batch) { // out of records, caller may be a reader so nothing waits here
+            deferBatch* safe = try_advance();
+            LeaveCriticalSection(&d.lock);
+            if (!safe) return -1;
+            free_batches(safe); // freed records make room, try again
+            return retire(cachep, objp);
+        }
+        batch->num = 0;
+        batch->next = d.retired[slot];
+        d.retired[slot] = batch;
+        d.batches[slot]++;
+    }
+    batch->items[batch->num].cachep = cachep;
+    batch->items[batch->num].obj = objp;
+    batch->num++;
+    deferBatch* safe = d.batches[slot] > DEFER_POLL ? try_advance() : 0;
+    LeaveCriticalSection(&d.lock);
+    free_batches(safe);
+    return 0;
+}
+
+int kmem_cache_free_deferred(kmem_cache_t* cachep, void* objp) {
+    if (cachep == 0) return -1;
+    return retire(cachep, objp);
+} // Free object after a grace period
+
+int kfree_deferred(const void* objp) {
+    return retire(0, (void*)objp);
+} // Free small memory buffer after a grace period
+
+void defer_forget_cache(kmem_cache_t* cachep) {
+    EnterCriticalSection(&d.lock);
+    for (int i = 0; i < 3; i++) {
+        for (deferBatch* batch = d.retired[i]; batch; batch = batch->next) {
+            unsigned n = 0;
+            for (unsigned j = 0; j < batch->num; j++) {
+                if (batch->items[j].cachep != cachep) batch->items[n++] = batch->items[j];
+            }
+            batch->num = n;
+        }
+    }
+    LeaveCriticalSection(&d.lock);
+}
+
+int defer_try_lock() {
+    return TryEnterCriticalSection(&d.lock) != 0;
+}
+
+void defer_unlock() {
+    LeaveCriticalSection(&d.lock);
+}
+
+int defer_pending_in(const void* start, const void* end) {
+    int num = 0;
+    for (int i = 0; i < 3; i++) {
+        for (deferBatch* batch = d.retired[i]; batch; batch = batch->next) {
+            for (unsigned j = 0; j < batch->num; j++) {
+                if (batch->items[j].obj >= start && batch->items[j].obj < end) num++;
+            }
+        }
+    }
+    return num;
+}
+
+int kmem_defer_poll() {
+    EnterCriticalSection(&d.lock);
+    deferBatch* safe = try_advance();
+    LeaveCriticalSection(&d.lock);
+    return free_batches(safe);
+} // Free objects whose grace period has passed, returns number of freed objects
+
+void kmem_defer_barrier() {
+    // two advances free everything retired before the call, including the current epoch
+    for (int i = 0; i < 2; ) {
+        EnterCriticalSection(&d.lock);
+        LONG64 e = d.epoch;
+        deferBatch* safe = try_advance();
+        int advanced = d.epoch != e;
+        LeaveCriticalSection(&d.lock);
+        free_batches(safe);
+        if (advanced) i++;
+        else SwitchToThread(); // readers still inside
+    }
+} // Wait until every deferred object is freed, not from a read-side section
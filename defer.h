@@ -0,0 +1,22 @@
+#ifndef _DEFER_H_
+#define _DEFER_H_
+#include "slab.h"
+
+// called once from kmem_init, public interface is in slab.h
+void defer_init();
+
+// for check_defer.c, epochs start next to a 32 bit boundary; no free may be pending
+void defer_set_epoch(long long epoch);
+
+// kmem_cache_defrag holds the allocator lock, which retire may wait for under the defer lock, so it only tries
+int defer_try_lock();
+
+void defer_unlock();
+
+// number of pending frees of objects in [start, end), caller holds the defer lock
+int defer_pending_in(const void* start, const void* end);
+
+// called from kmem_cache_destroy before it takes the allocator lock, drops pending frees of objects of cachep
+void defer_forget_cache(kmem_cache_t* cachep);
+
+#endif
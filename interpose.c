@@ -0,0 +1,206 @@
+// malloc family on top of kmalloc, built as a shared library and loaded ahead of the C runtime
+#include <windows.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include "slab.h"
+#include "buddy.h"
+#include "utilities.h"
+
+#define ARENA_BLOCKS (1 << 14) // 64MB unless KMEM_ARENA_BLOCKS asks for another size
+#define MAX_ARENA_BLOCKS (1 << (BUDDY_ORDERS - 1)) // largest arena buddy can manage
+#define MIN_ALIGN 16
+#define HEADER_SIZE sizeof(size_t) // distance from kmalloc buffer to returned pointer
+#define ALIGNED_BUCKETS 256
+
+#define EXPORT __declspec(dllexport)
+
+static INIT_ONCE arena_once = INIT_ONCE_STATIC_INIT;
+static void* arena_start;
+static void* arena_end;
+static size_t kmem_max; // largest size-N cache created at startup, larger requests go to the runtime
+
+// C runtime allocator, used for requests above KMALLOC_MAX, when the arena is full and for pointers that are not ours
+static void* (*real_malloc)(size_t);
+static void (*real_free)(void*);
+static void* (*real_realloc)(void*, size_t);
+static size_t (*real_msize)(void*);
+static void* (*real_aligned_malloc)(size_t, size_t);
+static void (*real_aligned_free)(void*);
+static size_t (*real_aligned_msize)(void*, size_t, size_t);
+
+// blocks from the runtime's _aligned_malloc, free has to return them with _aligned_free
+typedef struct aligned_block {
+    struct aligned_block* next;
+    void* ptr;
+    size_t align;
+} alignedBlock;
+
+static CRITICAL_SECTION aligned_lock;
+static alignedBlock* aligned_blocks[ALIGNED_BUCKETS];
+static volatile LONG aligned_num; // frees skip the lookup while there are none
+
+static BOOL CALLBACK arena_init(PINIT_ONCE once, void* param, void** ctx) {
+    HMODULE crt = GetModuleHandleA("ucrtbase.dll");
+    if (crt) {
+        real_malloc = (void* (*)(size_t))GetProcAddress(crt, "malloc");
+        real_free = (void (*)(void*))GetProcAddress(crt, "free");
+        real_realloc = (void* (*)(void*, size_t))GetProcAddress(crt, "realloc");
+        real_msize = (size_t (*)(void*))GetProcAddress(crt, "_msize");
+        real_aligned_malloc = (void* (*)(size_t, size_t))GetProcAddress(crt, "_aligned_malloc");
+        real_aligned_free = (void (*)(void*))GetProcAddress(crt, "_aligned_free");
+        real_aligned_msize = (size_t (*)(void*, size_t, size_t))GetProcAddress(crt, "_aligned_msize");
+    }
+    if (!InitializeCriticalSectionAndSpinCount(&aligned_lock, 0x00000400)) return FALSE;
+    unsigned block_num = ARENA_BLOCKS;
+    char env[16];
+    if (GetEnvironmentVariableA("KMEM_ARENA_BLOCKS", env, sizeof(env))) { // no getenv, it may allocate
+        unsigned n = (unsigned)strtoul(env, 0, 10);
+        if (n >= 2 && n <= MAX_ARENA_BLOCKS) block_num = 1U << pos(n); // buddy pairs are only exact for powers of two
+    }
+    arena_start = VirtualAlloc(0, (size_t)block_num * BLOCK_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (!arena_start) return FALSE;
+    arena_end = (void*)((uintptr_t)arena_start + (size_t)block_num * BLOCK_SIZE);
+    kmem_init(arena_start, block_num);
+    // size-N caches are created now, later a full arena fails quietly in kmem_cache_alloc and the runtime takes over
+    // instead of kmem_cache_create printing to the program's stdout on every request. Only caches whose slab surely
+    // fits are created, printf of a failure would call malloc and wait for this function to finish.
+    for (size_t size = 32; size <= KMALLOC_MAX && size / BLOCK_SIZE <= block_num / 4; size <<= 1) {
+        kfree(kmalloc(size));
+        kmem_max = size;
+    }
+    return TRUE;
+}
+
+static int arena_ready() {
+    return InitOnceExecuteOnce(&arena_once, arena_init, 0, 0) && arena_start;
+}
+
+static int is_ours(const void* ptr) {
+    return ptr >= arena_start && ptr < arena_end;
+}
+
+// kmalloc buffers are only 4 byte aligned, so the user pointer is aligned inside the buffer
+// and its offset is kept in the word right before it
+static void* aligned_alloc_internal(size_t align, size_t size) {
+    if (align < MIN_ALIGN) align = MIN_ALIGN;
+    if (!arena_ready()) return 0;
+    if (align > kmem_max / 2 || size > kmem_max - HEADER_SIZE - align) return 0;
+    void* raw = kmalloc(size + HEADER_SIZE + align - 1);
+    if (!raw) return 0;
+    uintptr_t user = ((uintptr_t)raw + HEADER_SIZE + align - 1) & ~(uintptr_t)(align - 1);
+    ((size_t*)user)[-1] = user - (uintptr_t)raw;
+    return (void*)user;
+}
+
+static void* raw_pointer(void* ptr) {
+    return (void*)((uintptr_t)ptr - ((size_t*)ptr)[-1]);
+}
+
+static unsigned aligned_bucket(const void* ptr) {
+    uintptr_t p = (uintptr_t)ptr;
+    return (unsigned)((p >> 4 ^ p >> 12 ^ p >> 20) % ALIGNED_BUCKETS);
+}
+
+// aligned requests the arena cannot serve, the block is recorded so free can tell it from a malloc block
+static void* runtime_aligned(size_t align, size_t size) {
+    if (!arena_ready() || !real_aligned_malloc || !real_aligned_free || !real_malloc) return 0;
+    alignedBlock* blk = (alignedBlock*)real_malloc(sizeof(alignedBlock));
+    if (!blk) return 0;
+    blk->ptr = real_aligned_malloc(size, align);
+    if (!blk->ptr) { real_free(blk); return 0; }
+    blk->align = align;
+    EnterCriticalSection(&aligned_lock);
+    blk->next = aligned_blocks[aligned_bucket(blk->ptr)];
+    aligned_blocks[aligned_bucket(blk->ptr)] = blk;
+    aligned_num++;
+    LeaveCriticalSection(&aligned_lock);
+    return blk->ptr;
+}
+
+// record of a runtime aligned block, taken out of the table if unlink is set
+static alignedBlock* aligned_lookup(const void* ptr, int unlink) {
+    if (!aligned_num) return 0;
+    EnterCriticalSection(&aligned_lock);
+    alignedBlock** prev = &aligned_blocks[aligned_bucket(ptr)];
+    for (; *prev && (*prev)->ptr != ptr; prev = &(*prev)->next);
+    alignedBlock* blk = *prev;
+    if (blk && unlink) {
+        *prev = blk->next;
+        aligned_num--;
+    }
+    LeaveCriticalSection(&aligned_lock);
+    return blk;
+}
+
+EXPORT void* malloc(size_t size) {
+    void* ptr = aligned_alloc_internal(MIN_ALIGN, size ? size : 1);
+    // larger than any size-N cache or arena is full, free and realloc send the pointer back to the runtime
+    if (!ptr && arena_ready() && real_malloc) ptr = real_malloc(size);
+    if (!ptr) errno = ENOMEM;
+    return ptr;
+}
+
+EXPORT void free(void* ptr) {
+    if (ptr == 0) return;
+    alignedBlock* blk = 0;
+    if (is_ours(ptr)) kfree(raw_pointer(ptr));
+    else if ((blk = aligned_lookup(ptr, 1))) {
+        real_aligned_free(ptr);
+        real_free(blk);
+    }
+    else if (real_free) real_free(ptr);
+    // foreign pointer without a runtime to return it to is leaked rather than corrupting the arena
+}
+
+EXPORT size_t malloc_usable_size(void* ptr) {
+    if (ptr == 0) return 0;
+    if (is_ours(ptr)) {
+        void* raw = raw_pointer(ptr);
+        return ksize(raw) - ((uintptr_t)ptr - (uintptr_t)raw);
+    }
+    alignedBlock* blk = aligned_lookup(ptr, 0);
+    if (blk) return real_aligned_msize ? real_aligned_msize(ptr, blk->align, 0) : 0;
+    return real_msize ? real_msize(ptr) : 0;
+}
+
+EXPORT void* calloc(size_t num, size_t size) {
+    if (size && num > (size_t)-1 / size) { errno = ENOMEM; return 0; }
+    void* ptr = malloc(num * size);
+    if (ptr) memset(ptr, 0, num * size);
+    return ptr;
+}
+
+EXPORT void* realloc(void* ptr, size_t size) {
+    if (ptr == 0) return malloc(size);
+    if (size == 0) { free(ptr); return 0; }
+    if (!is_ours(ptr) && !aligned_lookup(ptr, 0)) {
+        if (real_realloc) return real_realloc(ptr, size);
+        errno = ENOMEM;
+        return 0;
+    }
+    size_t old = malloc_usable_size(ptr);
+    if (size <= old && size > old / 2) return ptr; // shrinking into the same size-N cache
+    void* newPtr = malloc(size);
+    if (!newPtr) return 0;
+    memcpy(newPtr, ptr, size < old ? size : old);
+    free(ptr);
+    return newPtr;
+}
+
+EXPORT int posix_memalign(void** memptr, size_t align, size_t size) {
+    if (align < sizeof(void*) || (align & (align - 1))) return EINVAL;
+    void* ptr = aligned_alloc_internal(align, size ? size : 1);
+    if (!ptr) ptr = runtime_aligned(align, size ? size : 1); // larger than any size-N cache or arena is full
+    if (!ptr) return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+
+EXPORT void* aligned_alloc(size_t align, size_t size) {
+    if (align == 0 || (align & (align - 1))) { errno = EINVAL; return 0; }
+    void* ptr = aligned_alloc_internal(align, size ? size : 1);
+    if (!ptr) ptr = runtime_aligned(align, size ? size : 1); // larger than any size-N cache or arena is full
+    if (!ptr) errno = ENOMEM;
+    return ptr;
+}
@@ -0,0 +1,99 @@
+#include "lockstat.h"
+#include <stdio.h>
+#include <string.h>
+
+typedef struct lock_state {
+    kmem_lock_stat_t stats[LOCK_SITES];
+    unsigned depth; // recursion depth of the owner
+    int hold_site;
+    unsigned long long hold_start;
+    unsigned long long freq;
+} lockState;
+
+const char* lock_site_names[LOCK_SITES] = {
+    "kmem_cache_create", "kmem_cache_shrink", "kmem_cache_alloc", "kmem_cache_free",
+    "kmalloc", "kfree", "kmem_cache_destroy", "other"
+};
+
+lockState ls;
+
+unsigned long long now_ns() {
+    LARGE_INTEGER cnt;
+    if (!ls.freq) {
+        LARGE_INTEGER f;
+        QueryPerformanceFrequency(&f);
+        ls.freq = f.QuadPart;
+    }
+    QueryPerformanceCounter(&cnt);
+    return (unsigned long long)(cnt.QuadPart / ls.freq) * 1000000000ULL + (unsigned long long)(cnt.QuadPart % ls.freq) * 1000000000ULL / ls.freq;
+}
+
+unsigned hist_bucket(unsigned long long ns) {
+    unsigned i = 0;
+    while (ns > 1 && i < LOCK_HIST_SIZE - 1) {
+        ns >>= 1;
+        i++;
+    }
+    return i;
+}
+
+void lock_enter(CRITICAL_SECTION* cs, int site) {
+    unsigned long long wait = 0;
+    int contended = 0;
+    if (!TryEnterCriticalSection(cs)) {
+        unsigned long long start = now_ns();
+        EnterCriticalSection(cs);
+        wait = now_ns() - start;
+        contended = 1;
+    }
+    if (ls.depth++) return;
+    kmem_lock_stat_t* st = &ls.stats[site];
+    st->acquisitions++;
+    st->contended += contended;
+    st->wait_ns += wait;
+    st->wait_hist[hist_bucket(wait)]++;
+    ls.hold_site = site;
+    ls.hold_start = now_ns();
+}
+
+void lock_leave(CRITICAL_SECTION* cs) {
+    if (--ls.depth == 0) {
+        unsigned long long hold = now_ns() - ls.hold_start;
+        kmem_lock_stat_t* st = &ls.stats[ls.hold_site];
+        st->hold_ns += hold;
+        st->hold_hist[hist_bucket(hold)]++;
+    }
+    LeaveCriticalSection(cs);
+}
+
+void lock_stats_copy(kmem_lock_stat_t* stats) {
+    for (int i = 0; i < LOCK_SITES; i++) {
+        stats[i] = ls.stats[i];
+        stats[i].name = lock_site_names[i];
+    }
+}
+
+void lock_stats_reset() {
+    memset(ls.stats, 0, sizeof(ls.stats));
+}
+
+void print_hist(const char* title, unsigned long long* hist) {
+    printf("  %s:", title);
+    for (int i = 0; i < LOCK_HIST_SIZE; i++) {
+        if (hist[i]) printf(" <%lluns:%llu", 2ULL << i, hist[i]);
+    }
+    printf("\n");
+}
+
+void lock_stats_print() {
+    printf("--- lock stats ---\n");
+    for (int i = 0; i < LOCK_SITES; i++) {
+        kmem_lock_stat_t* st = &ls.stats[i];
+        if (!st->acquisitions) continue;
+        printf("%s: %llu acquisitions, %llu contended, wait %lluns, hold %lluns\n",
+            lock_site_names[i], st->acquisitions, st->contended, st->wait_ns, st->hold_ns);
+        print_hist("wait", st->wait_hist);
+        print_hist("hold", st->hold_hist);
+    }
+    printf("------------------\n");
+}
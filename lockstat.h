@@ -0,0 +1,50 @@
+#ifndef _LOCKSTAT_H_
+#define _LOCKSTAT_H_
+#include <windows.h>
+
+#define LOCK_HIST_SIZE 32 // bucket i counts times in [2^i, 2^(i+1)) ns, bucket 0 also counts 0
+
+// entry points that take the allocator lock
+enum lock_site {
+    LOCK_CACHE_CREATE,
+    LOCK_CACHE_SHRINK,
+    LOCK_CACHE_ALLOC,
+    LOCK_CACHE_FREE,
+    LOCK_KMALLOC,
+    LOCK_KFREE,
+    LOCK_CACHE_DESTROY,
+    LOCK_OTHER, // info, reclaim, profiler and other rarely used calls
+    LOCK_SITES
+};
+
+typedef struct kmem_lock_stat_s {
+    const char* name;
+    unsigned long long acquisitions;
+    unsigned long long contended; // lock was held by another thread
+    unsigned long long wait_ns;
+    unsigned long long hold_ns;
+    unsigned long long wait_hist[LOCK_HIST_SIZE];
+    unsigned long long hold_hist[LOCK_HIST_SIZE];
+} kmem_lock_stat_t;
+
+// nested acquisitions by the owner are not counted, hold time goes to the outermost entry point
+void lock_enter(CRITICAL_SECTION* cs, int site);
+
+void lock_leave(CRITICAL_SECTION* cs);
+
+// functions below expect the caller to hold the lock
+void lock_stats_copy(kmem_lock_stat_t* stats);
+
+void lock_stats_reset();
+
+void lock_stats_print();
+
+#ifdef KMEM_LOCK_STATS
+#define LOCK(cs, site) lock_enter(cs, site)
+#define UNLOCK(cs) lock_leave(cs)
+#else
+#define LOCK(cs, site) EnterCriticalSection(cs)
+#define UNLOCK(cs) LeaveCriticalSection(cs)
+#endif
+
+#endif
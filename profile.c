@@ -0,0 +1,189 @@
+#include "profile.h"
+#include <windows.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+#define PROF_BUCKETS 1024
+#define PROF_DEPTH 16
+#define PROF_SKIP 2 // prof_sample and kmem_cache_alloc frames
+
+typedef struct prof_stack {
+    struct prof_stack* next;
+    void* frames[PROF_DEPTH];
+    unsigned depth;
+    unsigned long hash;
+    unsigned long long live_count;
+    unsigned long long live_bytes;
+    unsigned long long total_count;
+    unsigned long long total_bytes;
+} profStack;
+
+typedef struct prof_sample {
+    struct prof_sample* next;
+    const void* obj;
+    kmem_cache_t* cachep;
+    profStack* stack;
+    size_t weight; // estimated bytes this sample stands for
+} profSample;
+
+typedef struct profiler {
+    profSample* samples[PROF_BUCKETS]; // by object address
+    profStack* stacks[PROF_BUCKETS]; // by stack hash
+    kmem_cache_t* sample_cache;
+    kmem_cache_t* stack_cache;
+    unsigned sample_bytes;
+    unsigned long long seed;
+    unsigned long long start_tick;
+    int inside;
+} profiler;
+
+profiler prof;
+long long prof_countdown = LLONG_MAX;
+unsigned prof_live = 0;
+
+// next countdown is uniform in [1, 2*sample_bytes], so on average one sample per sample_bytes
+long long next_countdown() {
+    prof.seed ^= prof.seed << 13;
+    prof.seed ^= prof.seed >> 7;
+    prof.seed ^= prof.seed << 17;
+    return 1 + (long long)(prof.seed % (2ULL * prof.sample_bytes));
+}
+
+unsigned obj_bucket(const void* obj) {
+    return (unsigned)(((unsigned long)obj >> 4) % PROF_BUCKETS);
+}
+
+profStack* find_stack(void** frames, unsigned depth, unsigned long hash) {
+    profStack* st = prof.stacks[hash % PROF_BUCKETS];
+    for (; st; st = st->next) {
+        if (st->hash == hash && st->depth == depth && memcmp(st->frames, frames, depth * sizeof(void*)) == 0) return st;
+    }
+    st = kmem_cache_alloc(prof.stack_cache);
+    if (!st) return 0;
+    memcpy(st->frames, frames, depth * sizeof(void*));
+    st->depth = depth;
+    st->hash = hash;
+    st->live_count = 0; st->live_bytes = 0;
+    st->total_count = 0; st->total_bytes = 0;
+    st->next = prof.stacks[hash % PROF_BUCKETS];
+    prof.stacks[hash % PROF_BUCKETS] = st;
+    return st;
+}
+
+void prof_sample(kmem_cache_t* cachep, const void* obj, size_t size) {
+    if (prof_countdown == LLONG_MAX || prof.inside) return;
+    prof_countdown = next_countdown();
+    prof.inside = 1; // allocations below must not be sampled
+    void* frames[PROF_DEPTH];
+    DWORD hash = 0;
+    unsigned depth = CaptureStackBackTrace(PROF_SKIP, PROF_DEPTH, frames, &hash);
+    profStack* st = find_stack(frames, depth, hash);
+    profSample* smp = st ? kmem_cache_alloc(prof.sample_cache) : 0;
+    if (smp) {
+        smp->obj = obj;
+        smp->cachep = cachep;
+        smp->stack = st;
+        smp->weight = size < prof.sample_bytes ? prof.sample_bytes : size;
+        smp->next = prof.samples[obj_bucket(obj)];
+        prof.samples[obj_bucket(obj)] = smp;
+        st->live_count++; st->live_bytes += smp->weight;
+        st->total_count++; st->total_bytes += smp->weight;
+        prof_live++;
+    }
+    prof.inside = 0;
+}
+
+void drop_sample(profSample** prev) {
+    profSample* smp = *prev;
+    *prev = smp->next;
+    smp->stack->live_count--;
+    smp->stack->live_bytes -= smp->weight;
+    prof_live--;
+    kmem_cache_free(prof.sample_cache, smp);
+}
+
+void prof_free(const void* obj) {
+    if (prof.inside) return;
+    prof.inside = 1;
+    for (profSample** prev = &prof.samples[obj_bucket(obj)]; *prev; prev = &(*prev)->next) {
+        if ((*prev)->obj == obj) { drop_sample(prev); break; }
+    }
+    prof.inside = 0;
+}
+
+void prof_move(const void* from, const void* to) {
+    for (profSample** prev = &prof.samples[obj_bucket(from)]; *prev; prev = &(*prev)->next) {
+        if ((*prev)->obj == from) {
+            profSample* smp = *prev;
+            *prev = smp->next;
+            smp->obj = to;
+            smp->next = prof.samples[obj_bucket(to)];
+            prof.samples[obj_bucket(to)] = smp;
+            break;
+        }
+    }
+}
+
+void prof_forget_cache(kmem_cache_t* cachep) {
+    prof.inside = 1;
+    for (int i = 0; i < PROF_BUCKETS; i++) {
+        profSample** prev = &prof.samples[i];
+        while (*prev) {
+            if ((*prev)->cachep == cachep) drop_sample(prev);
+            else prev = &(*prev)->next;
+        }
+    }
+    prof.inside = 0;
+}
+
+int prof_start(unsigned sample_bytes) {
+    if (prof.sample_cache) return -1; // already running
+    prof.inside = 1;
+    prof.sample_cache = kmem_cache_create("profile samples", sizeof(profSample), 0, 0);
+    prof.stack_cache = kmem_cache_create("profile stacks", sizeof(profStack), 0, 0);
+    prof.inside = 0;
+    if (!prof.sample_cache || !prof.stack_cache) {
+        kmem_cache_destroy(prof.sample_cache);
+        kmem_cache_destroy(prof.stack_cache);
+        prof.sample_cache = 0; prof.stack_cache = 0;
+        return -1;
+    }
+    for (int i = 0; i < PROF_BUCKETS; i++) {
+        prof.samples[i] = 0;
+        prof.stacks[i] = 0;
+    }
+    prof.sample_bytes = sample_bytes ? sample_bytes : PROF_DEFAULT_RATE;
+    prof.seed = GetTickCount64() | 1;
+    prof.start_tick = GetTickCount64();
+    prof_live = 0;
+    prof_countdown = next_countdown();
+    return 0;
+}
+
+void prof_stop() {
+    if (!prof.sample_cache) return;
+    prof_countdown = LLONG_MAX;
+    prof_live = 0;
+    prof.inside = 1;
+    kmem_cache_destroy(prof.sample_cache); // releases every sample and stack at once
+    kmem_cache_destroy(prof.stack_cache);
+    prof.inside = 0;
+    prof.sample_cache = 0; prof.stack_cache = 0;
+}
+
+void prof_dump() {
+    if (!prof.sample_cache) { printf("Profiler is not running.\n"); return; }
+    double seconds = (GetTickCount64() - prof.start_tick) / 1000.0;
+    if (seconds <= 0) seconds = 0.001;
+    printf("--- heap profile: 1 sample / %u B, %.3lf s ---\n", prof.sample_bytes, seconds);
+    printf("live objects: %u sampled\n", prof_live);
+    for (int i = 0; i < PROF_BUCKETS; i++) {
+        for (profStack* st = prof.stacks[i]; st; st = st->next) {
+            printf("live: %llu B in %llu samples, allocated: %llu B in %llu samples, %.1lf B/s\n",
+                st->live_bytes, st->live_count, st->total_bytes, st->total_count, st->total_bytes / seconds);
+            for (unsigned j = 0; j < st->depth; j++) printf("    #%u %p\n", j, st->frames[j]);
+        }
+    }
+    printf("-----------------\n");
+}
@@ -0,0 +1,33 @@
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+#include "slab.h"
+
+#define PROF_DEFAULT_RATE (512*1024) // average number of allocated bytes between two samples
+
+// all functions expect the caller to hold the allocator lock
+
+extern long long prof_countdown; // bytes until next sample, never reached while profiler is off
+extern unsigned prof_live; // number of sampled objects not yet freed
+
+// hot path hooks, one subtraction and one compare per allocation
+#define PROF_ALLOC(cachep, obj, size) do { if ((prof_countdown -= (long long)(size)) < 0) prof_sample(cachep, obj, size); } while (0)
+#define PROF_FREE(obj) do { if (prof_live) prof_free(obj); } while (0)
+#define PROF_MOVE(from, to) do { if (prof_live) prof_move(from, to); } while (0)
+
+void prof_sample(kmem_cache_t* cachep, const void* obj, size_t size);
+
+void prof_free(const void* obj);
+
+// object was relocated, its sample stays live under the new address
+void prof_move(const void* from, const void* to);
+
+// drop samples of objects that belong to cachep, called before cache is destroyed
+void prof_forget_cache(kmem_cache_t* cachep);
+
+int prof_start(unsigned sample_bytes);
+
+void prof_stop();
+
+void prof_dump();
+
+#endif
@@ -1,18 +1,34 @@
 #include "slab.h"
 #include "buddy.h"
 #include "utilities.h"
+#include "profile.h"
+#include "lockstat.h"
+#include "defer.h"
 #include <windows.h>
+#include <string.h>
 
 #define FRAGM_BORDER 512
 #define PTR_SIZE 8
 #define UINT_SIZE 4
 #define FREE_END 4096
 #define LARGE_OBJ 4030
-#define SLABS_L sizeof(slab) + 4
+#define SLABS_L ALIGN_LINE(sizeof(slab) + 4) // off-slab descriptors do not share cache lines
 #define SIZE_N_OFFSET 5
-
-#define CHECK_ALLOC(x) if(!x) \
-{ printf("Memory allocation error!"); exit(1);}
+#define MAX_SHRINKERS 16
+#ifndef PARTIAL_BUCKETS
+#define PARTIAL_BUCKETS 4 // 1 gives a single partial list
+#endif
+
+#ifndef KMEM_PACKED_LAYOUT
+#define CACHE_ALIGNED __declspec(align(64)) // CACHE_L1_LINE_SIZE, align() needs a literal
+#define ALIGN_LINE(x) (((unsigned long)(x) + CACHE_L1_LINE_SIZE - 1) & ~(unsigned long)(CACHE_L1_LINE_SIZE - 1))
+#else // descriptors, slab headers and objects packed back to back, for comparison in bench_threads.c
+#define CACHE_ALIGNED
+#define ALIGN_LINE(x) ((unsigned long)(x))
+#endif
+// objects and cache descriptors start on a new cache line after the header and the free list
+#define slabObjStart(object_num) ALIGN_LINE(sizeof(slab) + (object_num)*UINT_SIZE)
+#define cacheObjStart(cache_num) ALIGN_LINE(sizeof(cacheBlock) + (cache_num)*UINT_SIZE)
 
 #define slabListStart(ss) (unsigned int*)((unsigned long)ss + sizeof(slab))
 #define cacheListStart(start_addr) (unsigned int*)((unsigned long)start_addr + sizeof(cacheBlock))
@@ -28,6 +44,7 @@ cache_size_t cache_sizes[13];
 
 typedef struct Slab {
     struct Slab* next;
+    struct Slab* prev; // lists are doubly linked, a slab changes lists without a search
     void* firstObj;
     unsigned long colouroff;
     unsigned numAllocated;
@@ -40,23 +57,29 @@ void print_slab_info(slab* s) {
     printf("Number of allocated objects: %d\n", s->numAllocated);
     printf("Free slot head: %d\n", s->free);
     printf("Next slab: %p\n", s->next);
+    printf("Previous slab: %p\n", s->prev);
     printf("------------------------\n");
 }
 
+// read-mostly fields first, fields written on alloc and free start on their own cache line
 struct kmem_cache_s {
     char name[20];
     size_t object_size;
-    slab* empty;
-    slab* full;
-    slab* partial;
     void (*constructor)(void *);
     void (*destructor)(void *);
-    struct kmem_cache_s* next;
-    unsigned slab_offset;
     unsigned wastage;
     unsigned slab_size; 
-    unsigned slab_num;
     unsigned object_num;
+    unsigned reserved; // objects kept by shrink
+    int (*isolate)(void *); // relocation callbacks for defragmentation
+    void (*migrate)(void *, void *);
+    struct kmem_cache_s* next;
+    CACHE_ALIGNED slab* empty;
+    slab* full;
+    slab* partial[PARTIAL_BUCKETS]; // grouped by occupancy, last one holds the fullest slabs
+    unsigned slab_offset;
+    unsigned slab_num;
+    unsigned alloc_failures;
     int error;
     char flag;
 };
@@ -69,10 +92,28 @@ typedef struct cache_block {
     unsigned int inuse;
 } cacheBlock;
 
+// owner of one block of the arena, set for blocks that hold objects of a slab
+typedef struct block_owner_s {
+    kmem_cache_t* cachep;
+    slab* ss;
+} block_owner_t;
+
+typedef struct shrinker_s {
+    int (*shrink)(void *);
+    void* arg;
+} shrinker_t;
+
 typedef struct slab_allocator {
     cacheBlock* firstCacheBlock;
     kmem_cache_t* off_slab_cache;
+    kmem_cache_t* firstCache; // list of caches in use, linked through kmem_cache_s.next
     int cache_block_num;
+    shrinker_t shrinkers[MAX_SHRINKERS];
+    int shrinker_num;
+    int reclaiming;
+    block_owner_t* owners; // indexed by (addr - start_addr) / BLOCK_SIZE, frees find their slab without a search
+    void* start_addr;
+    unsigned block_num;
 } slabAllocator;
 
 slabAllocator s;
@@ -94,16 +135,17 @@ void print_cb_info() { // for testing purposes
 
 double calcUsage(kmem_cache_t* cachep) {
     int totalNumObject = cachep->slab_num*cachep->object_num;
+    if (totalNumObject == 0) return 0;
     int totalAllocatedObjects = 0;
     slab* currSlab = cachep->full;
     while(currSlab) {
         totalAllocatedObjects += cachep->object_num;
         currSlab = currSlab->next;
     }
-    currSlab = cachep->partial;
-    while(currSlab) {
-        totalAllocatedObjects += currSlab->numAllocated;
-        currSlab = currSlab->next;
+    for (int i = 0; i < PARTIAL_BUCKETS; i++) {
+        for (currSlab = cachep->partial[i]; currSlab; currSlab = currSlab->next) {
+            totalAllocatedObjects += currSlab->numAllocated;
+        }
     }
     return (totalAllocatedObjects*1.0/totalNumObject)*100;
 }
@@ -138,10 +180,9 @@ int calcNumPages(size_t size) {
 }
 
 int calcNumObject(size_t size, size_t slab_size) {
-    size_t total = slab_size*BLOCK_SIZE - sizeof(slab);
+    size_t total = slab_size*BLOCK_SIZE;
     int numObject = 0;
-    while (total >= UINT_SIZE + size) {
-        total -= (UINT_SIZE + size);
+    while (slabObjStart(numObject + 1) + (numObject + 1)*size <= total) {
         numObject++;
     }
     return numObject; 
@@ -149,10 +190,8 @@ int calcNumObject(size_t size, size_t slab_size) {
 
 int calcNumCaches() {
     size_t cache_size = sizeof(kmem_cache_t);
-    size_t total = BLOCK_SIZE - sizeof(cacheBlock); // minus pointer to next block of caches
     int numCaches = 0;
-    while (total >= UINT_SIZE + cache_size) {
-        total -= (UINT_SIZE + cache_size);
+    while (cacheObjStart(numCaches + 1) + (numCaches + 1)*cache_size <= BLOCK_SIZE) {
         numCaches++;
     }
     return numCaches;
@@ -161,7 +200,7 @@ int calcNumCaches() {
 void init_cache_block(cacheBlock* cb) {
     cb->next = 0;
     int cache_num = calcNumCaches();
-    cb->firstCache = (kmem_cache_t*)((unsigned long)cb + cache_num*UINT_SIZE + sizeof(cacheBlock));
+    cb->firstCache = (kmem_cache_t*)((unsigned long)cb + cacheObjStart(cache_num));
     cb->free = 0;
     cb->inuse = 0;
     unsigned int* lst = cacheListStart(cb);
@@ -181,12 +220,27 @@ void init_cache_sizes() {
 }
 
 void kmem_init(void* space, int block_num) {
+#ifndef KMEM_PACKED_LAYOUT
+    if ((unsigned long)space % CACHE_L1_LINE_SIZE) { // blocks must start on a cache line, give up the last one
+        space = (void*)ALIGN_LINE(space);
+        block_num--;
+    }
+#endif
     init_bud(space, block_num);
+    s.start_addr = space;
+    s.block_num = block_num;
+    s.owners = (block_owner_t*)alloc(nearestPowerOfTwo((block_num * sizeof(block_owner_t) + BLOCK_SIZE - 1) / BLOCK_SIZE));
+    if (!s.owners) { printf("Error: no memory for block owner table.\n"); exit(-1); }
+    memset(s.owners, 0, block_num * sizeof(block_owner_t));
     s.firstCacheBlock = (cacheBlock*)alloc(1);
     s.cache_block_num = 1;
     s.off_slab_cache = 0;
+    s.firstCache = 0;
+    s.shrinker_num = 0;
+    s.reclaiming = 0;
     init_cache_block(s.firstCacheBlock);
     init_cache_sizes();
+    defer_init();
     if (!InitializeCriticalSectionAndSpinCount(&CriticalSection, 0x00000400)) {
         printf("Error: initializing critical section.\n"); exit(-1);
     }
@@ -194,24 +248,72 @@ void kmem_init(void* space, int block_num) {
 }
 
 
+// single blocks go through per-cpu lists of the buddy allocator
+void* alloc_blocks_once(unsigned block_num) {
+    if (block_num == 1) return alloc_page(GetCurrentProcessorNumber());
+    return alloc(block_num);
+}
+
+// buddy alloc() that returns blocks parked in per-cpu lists and then falls back to global reclaim before giving up
+void* alloc_blocks(unsigned block_num) {
+    void* addr = alloc_blocks_once(block_num);
+    if (!addr && drain_pages()) addr = alloc_blocks_once(block_num);
+    if (!addr && !s.reclaiming) {
+        kmem_reclaim();
+        addr = alloc_blocks_once(block_num);
+    }
+    return addr;
+}
+
+void dealloc_blocks(void* addr, unsigned block_num) {
+    if (block_num == 1) dealloc_page(addr, GetCurrentProcessorNumber());
+    else dealloc(addr, block_num);
+}
+
+// records owner as the cache of the blocks that hold objects of ss, owner 0 clears them
+void set_owner(kmem_cache_t* cachep, slab* ss, kmem_cache_t* owner) {
+    void* objBlocks = (cachep->flag & 1) ? ss->firstObj : (void*)ss;
+    unsigned long first = ((unsigned long)objBlocks - (unsigned long)s.start_addr) / BLOCK_SIZE;
+    for (unsigned i = 0; i < cachep->slab_size; i++) {
+        s.owners[first + i].cachep = owner;
+        s.owners[first + i].ss = owner ? ss : 0;
+    }
+}
+
+void slab_push(slab** list, slab* ss) {
+    ss->prev = 0;
+    ss->next = *list;
+    if (*list) (*list)->prev = ss;
+    *list = ss;
+}
+
+void slab_unlink(slab** list, slab* ss) {
+    if (ss->prev) ss->prev->next = ss->next;
+    else *list = ss->next;
+    if (ss->next) ss->next->prev = ss->prev;
+}
+
 void cache_init(kmem_cache_t* cache, const char* name, size_t size, void (*ctor)(void *), void (*dtor)(void *)) {
     if (snprintf(cache->name, 20, "%s", name) < 0) cache->error = 1;
     else cache->error = 0;
     cache->object_size = size;
     cache->slab_size = calcNumPages(size);
-    cache->slab_num = 1;
-    cache->partial = 0; cache->full = 0;
+    cache->slab_num = 0;
+    cache->alloc_failures = 0;
+    cache->reserved = 0;
+    cache->isolate = 0;
+    cache->migrate = 0;
+    for (int i = 0; i < PARTIAL_BUCKETS; i++) cache->partial[i] = 0;
+    cache->full = 0; cache->empty = 0;
+    cache->next = 0;
     if (size <= LARGE_OBJ) {
         cache->flag = 0;
-        cache->empty = alloc(1);
-        CHECK_ALLOC(cache->empty);
         cache->object_num = calcNumObject(size, cache->slab_size); // per slab
-        cache->wastage = cache->slab_size * BLOCK_SIZE - sizeof(slab) - cache->object_num * (4 + size);
+        cache->wastage = cache->slab_size * BLOCK_SIZE - slabObjStart(cache->object_num) - cache->object_num * size;
         cache->slab_offset = 0;
     }
     else {
         if (!s.off_slab_cache) s.off_slab_cache = kmem_cache_create("off-slabs", SLABS_L, 0, 0);
-        cache->empty = kmem_cache_alloc(s.off_slab_cache);
         cache->flag = 1;
         cache->object_num = cache->slab_size*BLOCK_SIZE/size;
         cache->wastage = 0;
@@ -222,7 +324,7 @@ void cache_init(kmem_cache_t* cache, const char* name, size_t size, void (*ctor)
     
 }
 
-void slab_init(kmem_cache_t * cachep, slab* ss) {
+int slab_init(kmem_cache_t * cachep, slab* ss) {
     ss->free = 0;
     ss->colouroff = cachep->slab_offset;
     // update offset for colouroff
@@ -231,10 +333,11 @@ void slab_init(kmem_cache_t * cachep, slab* ss) {
         else cachep->slab_offset += CACHE_L1_LINE_SIZE;
     }
     // set parameters
-    if(!(cachep->flag & 1)) ss->firstObj = (void*)((unsigned long)ss + sizeof(slab) + cachep->object_num*UINT_SIZE + ss->colouroff);
-    else { ss->firstObj = alloc(cachep->slab_size); CHECK_ALLOC(ss->firstObj); }
+    if(!(cachep->flag & 1)) ss->firstObj = (void*)((unsigned long)ss + slabObjStart(cachep->object_num) + ss->colouroff);
+    else { ss->firstObj = alloc_blocks(cachep->slab_size); if (!ss->firstObj) return -1; }
     ss->numAllocated = 0;
     ss->next = 0;
+    ss->prev = 0;
     // initialize free list
     unsigned int* lst = (unsigned int*)((unsigned long int)ss + sizeof(slab));
     for (unsigned i = 0; i < cachep->object_num - 1; i++) {
@@ -249,17 +352,34 @@ void slab_init(kmem_cache_t * cachep, slab* ss) {
             currSlot = (void*)((unsigned long)currSlot + cachep->object_size);
         }
     }
+    return 0;
+}
+
+// allocates and initializes one slab; returns 0 if memory is exhausted even after reclaim
+slab* cache_grow(kmem_cache_t* cachep) {
+    slab* ss = 0;
+    if (cachep->flag & 1) ss = kmem_cache_alloc(s.off_slab_cache);
+    else ss = alloc_blocks(cachep->slab_size);
+    if (!ss) return 0;
+    if (slab_init(cachep, ss) < 0) {
+        if (cachep->flag & 1) kmem_cache_free(s.off_slab_cache, ss);
+        else dealloc_blocks(ss, cachep->slab_size);
+        return 0;
+    }
+    set_owner(cachep, ss, cachep);
+    cachep->slab_num++;
+    return ss;
 }
 
 kmem_cache_t* kmem_cache_create(const char* name, size_t size, void (*ctor)(void *), void (*dtor)(void *)) {
-    EnterCriticalSection(&CriticalSection);
+    LOCK(&CriticalSection, LOCK_CACHE_CREATE);
     // allocate new cache
     cacheBlock* cb = s.firstCacheBlock;
-    while (cb->free == FREE_END) cb = cb->next; // find cache block with empty slots
+    while (cb && cb->free == FREE_END) cb = cb->next; // find cache block with empty slots
     // 
     if (cb == 0) { // no cache block with empty caches
-        cb = (cacheBlock*)alloc(1); // print_arr();
-        CHECK_ALLOC(cb);
+        cb = (cacheBlock*)alloc_blocks(1); // print_arr();
+        if (!cb) { printf("Error: no memory for cache %s.\n", name); UNLOCK(&CriticalSection); return 0; }
         cb->next = s.firstCacheBlock;
         s.firstCacheBlock = cb;
         s.cache_block_num++;
@@ -269,78 +389,209 @@ kmem_cache_t* kmem_cache_create(const char* name, size_t size, void (*ctor)(void
     kmem_cache_t* new_cache = (kmem_cache_t*)((unsigned long)cb->firstCache + cb->free * sizeof(kmem_cache_t));
     // update cache block
     unsigned int* lst = cacheListStart(cb);
+    int index = cb->free;
     cb->free = lst[cb->free];
     cb->inuse++;
     // initialize cache
     cache_init(new_cache, name, size, ctor, dtor);
     // initialize slab
-    slab_init(new_cache, (slab*)new_cache->empty);
+    new_cache->empty = cache_grow(new_cache);
+    if (!new_cache->empty) { // give the slot back
+        printf("Error: no memory for cache %s.\n", name);
+        lst[index] = cb->free;
+        cb->free = index;
+        cb->inuse--;
+        UNLOCK(&CriticalSection);
+        return 0;
+    }
+    new_cache->next = s.firstCache;
+    s.firstCache = new_cache;
     
     /* check if cache block full*/
-    LeaveCriticalSection(&CriticalSection);
+    UNLOCK(&CriticalSection);
     return new_cache;
 } // Allocate cache
 
 int kmem_cache_shrink(kmem_cache_t* cachep) {
     if (cachep == 0) return -1;
-    EnterCriticalSection(&CriticalSection);
+    LOCK(&CriticalSection, LOCK_CACHE_SHRINK);
     int numBlocks = 0;
     slab* curr = cachep->empty;
-    while (curr) {
+    while (curr && (cachep->slab_num - 1) * cachep->object_num >= cachep->reserved) { // reserved slabs stay
         slab* next = curr->next;
+        set_owner(cachep, curr, 0);
         if (cachep->flag & 1) {
-            dealloc(curr->firstObj, cachep->slab_size); 
+            dealloc_blocks(curr->firstObj, cachep->slab_size); 
             kmem_cache_free(s.off_slab_cache, curr);
         } else {
-            dealloc(curr, cachep->slab_size); 
+            dealloc_blocks(curr, cachep->slab_size); 
         }
         numBlocks += cachep->slab_size;
         cachep->slab_num--;
         curr = next;
     }
-    cachep->empty = 0;
-    LeaveCriticalSection(&CriticalSection);
+    cachep->empty = curr;
+    if (curr) curr->prev = 0;
+    UNLOCK(&CriticalSection);
     return numBlocks;
 } // Shrink cache
 
+// adds num empty slabs, on-slab caches take them from buddy in as few chunks as possible; returns number of added slabs
+unsigned cache_grow_batch(kmem_cache_t* cachep, unsigned num) {
+    unsigned added = 0;
+    while (added < num) {
+        unsigned chunk = 1U << pos(num - added);
+        void* addr = 0;
+        if (!(cachep->flag & 1)) {
+            for (; chunk > 1 && !(addr = alloc(chunk * cachep->slab_size)); chunk >>= 1);
+        }
+        if (!addr) { // one slab at a time, with reclaim
+            slab* ss = cache_grow(cachep);
+            if (!ss) break;
+            slab_push(&cachep->empty, ss);
+            added++;
+            continue;
+        }
+        for (unsigned i = 0; i < chunk; i++) {
+            slab* ss = (slab*)((unsigned long)addr + i * cachep->slab_size * BLOCK_SIZE);
+            slab_init(cachep, ss); // cannot fail for on-slab caches
+            set_owner(cachep, ss, cachep);
+            cachep->slab_num++;
+            slab_push(&cachep->empty, ss);
+        }
+        added += chunk;
+    }
+    return added;
+}
+
+int kmem_cache_reserve(kmem_cache_t* cachep, unsigned n_objects) {
+    if (cachep == 0) return -1;
+    LOCK(&CriticalSection, LOCK_OTHER);
+    cachep->reserved = n_objects;
+    unsigned needed = (n_objects + cachep->object_num - 1) / cachep->object_num;
+    int ret = 0;
+    if (needed > cachep->slab_num) {
+        unsigned num = needed - cachep->slab_num;
+        if (cache_grow_batch(cachep, num) < num) {
+            cachep->alloc_failures++;
+            cachep->error = 2;
+            ret = -1;
+        }
+    }
+    UNLOCK(&CriticalSection);
+    return ret;
+} // Grow cache to hold n_objects and keep them from shrink
+
+void kmem_cache_unreserve(kmem_cache_t* cachep) {
+    if (cachep == 0) return;
+    LOCK(&CriticalSection, LOCK_OTHER);
+    cachep->reserved = 0;
+    UNLOCK(&CriticalSection);
+} // Let shrink release reserved slabs again
+
+kmem_cache_t* kmem_cache_create_reserved(const char* name, size_t size, void (*ctor)(void *), void (*dtor)(void *), unsigned min_objects) {
+    kmem_cache_t* cachep = kmem_cache_create(name, size, ctor, dtor);
+    if (cachep && kmem_cache_reserve(cachep, min_objects) < 0) {
+        kmem_cache_destroy(cachep);
+        return 0;
+    }
+    return cachep;
+} // Allocate cache with min_objects reserved
+
+int kmem_register_shrinker(int (*shrinker)(void *), void* arg) {
+    if (shrinker == 0) return -1;
+    LOCK(&CriticalSection, LOCK_OTHER);
+    if (s.shrinker_num == MAX_SHRINKERS) { UNLOCK(&CriticalSection); return -1; }
+    s.shrinkers[s.shrinker_num].shrink = shrinker;
+    s.shrinkers[s.shrinker_num].arg = arg;
+    s.shrinker_num++;
+    UNLOCK(&CriticalSection);
+    return 0;
+} // Register reclaim callback
+
+void kmem_unregister_shrinker(int (*shrinker)(void *), void* arg) {
+    LOCK(&CriticalSection, LOCK_OTHER);
+    for (int i = 0; i < s.shrinker_num; i++) {
+        if (s.shrinkers[i].shrink == shrinker && s.shrinkers[i].arg == arg) {
+            s.shrinkers[i] = s.shrinkers[--s.shrinker_num];
+            break;
+        }
+    }
+    UNLOCK(&CriticalSection);
+} // Remove reclaim callback
+
+int kmem_reclaim() {
+    LOCK(&CriticalSection, LOCK_OTHER);
+    if (s.reclaiming) { UNLOCK(&CriticalSection); return 0; }
+    s.reclaiming = 1;
+    int numBlocks = 0;
+    // shrinkers first, they usually free objects and leave empty slabs behind
+    for (int i = 0; i < s.shrinker_num; i++) {
+        numBlocks += (*s.shrinkers[i].shrink)(s.shrinkers[i].arg);
+    }
+    for (kmem_cache_t* cachep = s.firstCache; cachep; cachep = cachep->next) {
+        if (cachep->migrate) numBlocks += kmem_cache_defrag(cachep);
+        if (cachep != s.off_slab_cache) numBlocks += kmem_cache_shrink(cachep);
+    }
+    // off-slab descriptors are released by the pass above
+    if (s.off_slab_cache) numBlocks += kmem_cache_shrink(s.off_slab_cache);
+    // blocks parked in per-cpu lists are needed for multi-block requests
+    drain_pages();
+    s.reclaiming = 0;
+    UNLOCK(&CriticalSection);
+    return numBlocks;
+} // Shrink every cache and run shrinkers
+
+// index of the partial list for a slab, higher index holds fuller slabs
+int partial_bucket(kmem_cache_t* cachep, slab* ss) {
+    return ss->numAllocated * PARTIAL_BUCKETS / cachep->object_num;
+}
+
+// takes one object from ss, which is head of partial[bucket] or not linked anywhere if bucket is -1
+void* slab_take_obj(kmem_cache_t* cachep, slab* ss, int bucket) {
+    void * obj = (void*)((unsigned long)ss->firstObj + ss->free*cachep->object_size);
+    unsigned int* lst = slabListStart(ss);
+    ss->free = lst[ss->free];
+    ss->numAllocated++;
+    if (ss->free == FREE_END) { // reallocate slab to full list
+        if (bucket >= 0) slab_unlink(&cachep->partial[bucket], ss);
+        slab_push(&cachep->full, ss);
+    } else if (partial_bucket(cachep, ss) != bucket) { // slab crossed into a fuller bucket
+        if (bucket >= 0) slab_unlink(&cachep->partial[bucket], ss);
+        slab_push(&cachep->partial[partial_bucket(cachep, ss)], ss);
+    }
+    return obj;
+}
+
 void* kmem_cache_alloc(kmem_cache_t* cachep) {
     if (cachep == 0) return 0;
-    EnterCriticalSection(&CriticalSection);
+    LOCK(&CriticalSection, LOCK_CACHE_ALLOC);
     slab* ss = 0;
-    if (cachep->partial) ss = cachep->partial; 
-    else if (cachep->empty) { // use empty slab and link it to partial slabs list
+    int bucket = PARTIAL_BUCKETS - 1;
+    for (; bucket >= 0 && !cachep->partial[bucket]; bucket--); // prefer the fullest partial slab
+    if (bucket >= 0) ss = cachep->partial[bucket]; 
+    else if (cachep->empty) { // use empty slab, it is linked to partial list below
         ss = cachep->empty;
-        ss->next = cachep->partial;
-        cachep->partial = ss;
-        cachep->empty = cachep->empty->next;
+        slab_unlink(&cachep->empty, ss);
         
     } else { // no partial nor empty slab --> allocate new partial slab
-        if (cachep->flag & 1) {
-            cachep->partial = kmem_cache_alloc(s.off_slab_cache);
-        } else {
-            cachep->partial = alloc(1);
-            CHECK_ALLOC(cachep->partial);
+        ss = cache_grow(cachep);
+        if (!ss) {
+            cachep->alloc_failures++;
+            cachep->error = 2;
+            UNLOCK(&CriticalSection);
+            return 0;
         }
-        cachep->slab_num += cachep->slab_size;
-        slab_init(cachep, (slab*)cachep->partial);
         if ((cachep->flag >> 1) & 2) {
             printf("%s called alloc after shrink\n", cachep->name);
             cachep->flag |= 4;
         }
-        ss = cachep->partial;
     }
 
-    void * obj = (void*)((unsigned long)ss->firstObj + ss->free*cachep->object_size);
-    unsigned int* lst = slabListStart(ss);
-    ss->free = lst[ss->free];
-    ss->numAllocated++;
-    if (ss->free == FREE_END) { // reallocate slab to full list
-        cachep->partial = cachep->partial->next;
-        ss->next = cachep->full;
-        cachep->full = ss;
-    }
+    void* obj = slab_take_obj(cachep, ss, bucket);
+    PROF_ALLOC(cachep, obj, cachep->object_size);
 
-    LeaveCriticalSection(&CriticalSection);
+    UNLOCK(&CriticalSection);
     return obj;
 } // Allocate one object from cache
 
@@ -351,157 +602,234 @@ void free_object(int index, slab* currSlab) {
     currSlab->free = index;
 }
 
-void* find_obj(kmem_cache_t* cachep, slab* currSlab, const void* objp) { // search slabs for obj
-    while (currSlab) { 
-        if (objp >= currSlab->firstObj && objp < (void*)((unsigned long)currSlab + cachep->slab_size*BLOCK_SIZE)) {
-            return currSlab;
-        }
-        currSlab = currSlab->next;
+// cache whose slab holds the block of objp, 0 if the block is not part of a slab
+kmem_cache_t* find_cache(const void* objp) {
+    if (objp < s.start_addr || objp >= (void*)((unsigned long)s.start_addr + s.block_num*BLOCK_SIZE)) return 0;
+    return s.owners[((unsigned long)objp - (unsigned long)s.start_addr) / BLOCK_SIZE].cachep;
+}
+
+// full or partial slab of cachep that holds obj, list is set to the list that holds the slab
+slab* find_slab(kmem_cache_t* cachep, const void* objp, slab*** list) {
+    if (find_cache(objp) != cachep) return 0;
+    slab* currSlab = s.owners[((unsigned long)objp - (unsigned long)s.start_addr) / BLOCK_SIZE].ss;
+    if (currSlab->numAllocated == 0 || objp < currSlab->firstObj) return 0;
+    if (objp >= (void*)((unsigned long)currSlab->firstObj + cachep->object_num*cachep->object_size)) return 0;
+    // slabs are always on the list for their occupancy
+    if (currSlab->numAllocated == cachep->object_num) *list = &cachep->full;
+    else *list = &cachep->partial[partial_bucket(cachep, currSlab)];
+    return currSlab;
+}
+
+// size-N cache that holds objp, 0 for objects of other caches
+kmem_cache_t* find_size_cache(const void* objp) {
+    kmem_cache_t* cachep = find_cache(objp);
+    for (int i = 0; cachep && i < 13; i++) {
+        if (cache_sizes[i].cs_cachep == cachep) return cachep;
     }
     return 0;
 }
 
-void kmem_cache_free(kmem_cache_t* cachep, void* objp) {
-    if (cachep == 0 || objp == 0) return;
-    EnterCriticalSection(&CriticalSection);
-    /* find slab where objp is */
-    slab* currSlab = 0;
-    char listFlag = 0;
-    if (cachep->full) {
-        currSlab = find_obj(cachep, cachep->full, objp);
-        listFlag = 'f';
-    }
-    if (currSlab == 0 && cachep->partial) {
-        currSlab = find_obj(cachep, cachep->partial, objp);
-        listFlag = 'p';
-    }
-    if (!currSlab) { printf("Object not found in cache %s.\n", cachep->name); LeaveCriticalSection(&CriticalSection); return; }
-    /* free object */
+void cache_free_obj(kmem_cache_t* cachep, slab* currSlab, slab** list, const void* objp) {
     int index = ((unsigned long)objp - (unsigned long)currSlab->firstObj)/cachep->object_size;
+    PROF_FREE(objp);
     free_object(index, currSlab);
-    if (cachep->destructor) (*(cachep->destructor))(objp); /* pozvati destruktor*/
-    if (listFlag == 'f') { /* full slab -> partial slab*/
-        if (cachep->full == currSlab) cachep->full = cachep->full->next;
-        else {
-            slab* prevSlab = cachep->full;
-            for (; prevSlab->next != currSlab; prevSlab = prevSlab->next);
-            prevSlab->next = currSlab->next;
-        }
-        
-        currSlab->next = cachep->partial;
-        cachep->partial = currSlab;
-    }/* partial slab -> empty slab*/
-    else if (listFlag == 'p' && currSlab->numAllocated == 0) { // reallocate to empty list
-        if (cachep->partial == currSlab) cachep->partial = cachep->partial->next;
-        else {
-            slab* prevSlab = cachep->partial;
-            for (; prevSlab->next != currSlab; prevSlab = prevSlab->next);
-            prevSlab->next = currSlab->next;
-        }
-        currSlab->next = cachep->empty;
-        cachep->empty = currSlab;
+    if (cachep->destructor) (*(cachep->destructor))((void*)objp); /* pozvati destruktor*/
+    if (currSlab->numAllocated == 0) { /* -> empty slab */
+        slab_unlink(list, currSlab);
+        slab_push(&cachep->empty, currSlab);
         if (!((cachep->flag >> 1) & 1)) cachep->flag |= 2;
         if ((cachep->flag >> 1) != 3) {
             kmem_cache_shrink(cachep);
         }
+    } else { /* full slab -> partial slab, or partial slab -> emptier bucket */
+        slab** newList = &cachep->partial[partial_bucket(cachep, currSlab)];
+        if (newList != list) {
+            slab_unlink(list, currSlab);
+            slab_push(newList, currSlab);
+        }
     }
-    LeaveCriticalSection(&CriticalSection);
+}
+
+void kmem_cache_free(kmem_cache_t* cachep, void* objp) {
+    if (cachep == 0 || objp == 0) return;
+    LOCK(&CriticalSection, LOCK_CACHE_FREE);
+    /* find slab where objp is */
+    slab** list = 0;
+    slab* currSlab = find_slab(cachep, objp, &list);
+    if (!currSlab) { printf("Object not found in cache %s.\n", cachep->name); UNLOCK(&CriticalSection); return; }
+    /* free object */
+    cache_free_obj(cachep, currSlab, list, objp);
+    UNLOCK(&CriticalSection);
 } // Deallocate one object from cache
 
 
 void* kmalloc(size_t size) {
-    if (size == 0) return 0;
+    if (size == 0 || size > KMALLOC_MAX) return 0;
+    if (size < cache_sizes[0].cs_size) size = cache_sizes[0].cs_size; // smallest size-N cache
     size = nearestPowerOfTwo(size);
     int index = power_of_two(size); 
-    EnterCriticalSection(&CriticalSection);
+    LOCK(&CriticalSection, LOCK_KMALLOC);
     if (!cache_sizes[index - SIZE_N_OFFSET].cs_cachep) {
         char name[20];
         sprintf_s(name, 20, "%lu", size);
         cache_sizes[index - SIZE_N_OFFSET].cs_cachep = kmem_cache_create(name, size, 0, 0);
+        if (!cache_sizes[index - SIZE_N_OFFSET].cs_cachep) { UNLOCK(&CriticalSection); return 0; }
     }
-    LeaveCriticalSection(&CriticalSection);
+    UNLOCK(&CriticalSection);
     return kmem_cache_alloc(cache_sizes[index - SIZE_N_OFFSET].cs_cachep);
 } // Allocate one small memmory buffer 
 
-void* find_buffer(kmem_cache_t* cachep, slab* currSlab, const void* objp) { // search slabs for obj
-    while (currSlab) {
-        if (objp >= currSlab->firstObj && objp < (void*)((unsigned long)currSlab->firstObj + cachep->slab_size * BLOCK_SIZE)) {
-            return currSlab;
+void kfree(const void* objp) {
+    if (objp == 0) return;
+    LOCK(&CriticalSection, LOCK_KFREE);
+    kmem_cache_t* cachep = find_size_cache(objp);
+    slab* currSlab = 0;
+    slab** list = 0;
+    if (cachep) currSlab = find_slab(cachep, objp, &list);
+    if (!currSlab) { printf("Object not found.\n"); UNLOCK(&CriticalSection); return; }
+    cache_free_obj(cachep, currSlab, list, objp);
+    UNLOCK(&CriticalSection);
+} // Deallocate one small memory buffer
+
+size_t ksize(const void* objp) {
+    if (objp == 0) return 0;
+    LOCK(&CriticalSection, LOCK_OTHER);
+    size_t size = 0;
+    slab** list = 0;
+    kmem_cache_t* cachep = find_size_cache(objp);
+    if (cachep && find_slab(cachep, objp, &list)) size = cachep->object_size;
+    UNLOCK(&CriticalSection);
+    return size;
+} // Usable size of a small memory buffer
+
+// objects next to each other in objs that share a slab are freed without another slab lookup
+void free_bulk(kmem_cache_t* cachep, void** objs, unsigned n) {
+    kmem_cache_t* currCache = 0;
+    slab* currSlab = 0;
+    slab** list = 0;
+    for (unsigned j = 0; j < n; j++) {
+        void* objp = objs[j];
+        if (objp == 0) continue;
+        if (!currSlab || objp < currSlab->firstObj || objp >= (void*)((unsigned long)currSlab->firstObj + currCache->object_num*currCache->object_size)) {
+            currSlab = 0;
+            currCache = cachep ? cachep : find_size_cache(objp);
+            if (currCache) currSlab = find_slab(currCache, objp, &list);
+            if (!currSlab) { printf("Object not found.\n"); continue; }
         }
-        currSlab = currSlab->next;
+        int last = currSlab->numAllocated == 1; // slab goes to empty list and may be released
+        cache_free_obj(currCache, currSlab, list, objp);
+        if (last) currSlab = 0;
+        else list = &currCache->partial[partial_bucket(currCache, currSlab)];
     }
-    return 0;
 }
 
-void kfree(const void* objp) {
-    if (objp == 0) return;
-    EnterCriticalSection(&CriticalSection);
-    int i = 0;
-    slab* currSlab = 0;
-    char listFlag = 0;
-    for (; i < 13; i++) { // search slabs for every sizeN_cache
-        if (cache_sizes[i].cs_cachep){
-            if (cache_sizes[i].cs_cachep->full) {
-                currSlab = find_buffer(cache_sizes[i].cs_cachep, cache_sizes[i].cs_cachep->full, objp);
-                if (currSlab) { listFlag = 'f'; break; }
-            }
-            if (cache_sizes[i].cs_cachep->partial) {
-                currSlab = find_buffer(cache_sizes[i].cs_cachep, cache_sizes[i].cs_cachep->partial, objp);
-                if (currSlab) { listFlag = 'p'; break; }
-            }
-        } 
+void kmem_cache_free_bulk(kmem_cache_t* cachep, void** objs, unsigned n) {
+    if (cachep == 0 || objs == 0) return;
+    LOCK(&CriticalSection, LOCK_CACHE_FREE);
+    free_bulk(cachep, objs, n);
+    UNLOCK(&CriticalSection);
+} // Deallocate n objects from cache
+
+void kfree_bulk(void** objs, unsigned n) {
+    if (objs == 0) return;
+    LOCK(&CriticalSection, LOCK_KFREE);
+    free_bulk(0, objs, n);
+    UNLOCK(&CriticalSection);
+} // Deallocate n small memory buffers
+
+void kmem_cache_set_relocate(kmem_cache_t* cachep, int (*isolate)(void *), void (*migrate)(void *, void *)) {
+    if (cachep == 0) return;
+    LOCK(&CriticalSection, LOCK_OTHER);
+    cachep->isolate = isolate;
+    cachep->migrate = migrate;
+    UNLOCK(&CriticalSection);
+} // Register object relocation callbacks
+
+unsigned free_slots(kmem_cache_t* cachep, slab* ss) {
+    unsigned num = 0;
+    for (; ss; ss = ss->next) num += cachep->object_num - ss->numAllocated;
+    return num;
+}
+
+// puts a detached partial slab back on the list for its occupancy, or on empty list
+void slab_relink(kmem_cache_t* cachep, slab* ss) {
+    slab** list = ss->numAllocated ? &cachep->partial[partial_bucket(cachep, ss)] : &cachep->empty;
+    slab_push(list, ss);
+}
+
+// moves every object out of src into fuller slabs, returns 0 if an object could not be isolated;
+// a slab with a pending deferred free is left alone, the grace period would free the old address
+int drain_slab(kmem_cache_t* cachep, slab* src) {
+    if (defer_pending_in(src->firstObj, (void*)((unsigned long)src->firstObj + cachep->object_num*cachep->object_size))) return 0;
+    char isFree[FREE_END];
+    memset(isFree, 0, cachep->object_num);
+    unsigned int* lst = slabListStart(src);
+    for (unsigned i = src->free; i != FREE_END; i = lst[i]) isFree[i] = 1;
+    for (unsigned i = 0; i < cachep->object_num; i++) {
+        if (isFree[i]) continue;
+        void* from = (void*)((unsigned long)src->firstObj + i*cachep->object_size);
+        if (!(*cachep->isolate)(from)) return 0;
+        int bucket = PARTIAL_BUCKETS - 1;
+        for (; bucket >= 0 && !cachep->partial[bucket]; bucket--); // fullest slab, caller made sure there is room
+        void* to = slab_take_obj(cachep, cachep->partial[bucket], bucket);
+        memcpy(to, from, cachep->object_size);
+        (*cachep->migrate)(from, to);
+        PROF_MOVE(from, to);
+        free_object(i, src); // no destructor, object lives on at its new address
     }
-    if (!currSlab) { printf("Object not found.\n"); LeaveCriticalSection(&CriticalSection); return; }
-    int index = ((unsigned long)objp - (unsigned long)currSlab->firstObj)/cache_sizes[i].cs_cachep->object_size;
-    free_object(index, currSlab);
-    kmem_cache_t* cachep = cache_sizes[i].cs_cachep;
-    if (listFlag == 'f' && currSlab->numAllocated > 0) { /* full slab -> partial slab*/
-        if (cachep->full == currSlab) cachep->full = cachep->full->next;
-        else {
-            slab* prevSlab = cachep->full;
-            for (; prevSlab->next != currSlab; prevSlab = prevSlab->next);
-            prevSlab->next = currSlab->next;
-        }
-        currSlab->next = cachep->partial;
-        cachep->partial = currSlab;
-    } else if(listFlag == 'f' && currSlab->numAllocated == 0){ /* full slab -> empty slab*/
-        if (cachep->full == currSlab) cachep->full = cachep->full->next;
-       else {
-            slab* prevSlab = cachep->full;
-            for (; prevSlab->next != currSlab; prevSlab = prevSlab->next);
-            prevSlab->next = currSlab->next;
-        }
-        currSlab->next = cachep->empty;
-        cachep->empty = currSlab;
-        if (!((cachep->flag >> 1) & 1)) cachep->flag |= 2;
-        else if ((cachep->flag >> 1) != 3) {
-            kmem_cache_shrink(cachep);
-        }
-    } else if (listFlag == 'p' && currSlab->numAllocated == 0) { /* partial slab -> empty slab -> deallocate*/
-        if (cachep->partial == currSlab) cachep->partial = cachep->partial->next;
-        else {
-            slab* prevSlab = cachep->partial;
-            for (; prevSlab->next != currSlab; prevSlab = prevSlab->next);
-            prevSlab->next = currSlab->next;
+    return 1;
+}
+
+int kmem_cache_defrag(kmem_cache_t* cachep) {
+    if (cachep == 0 || !cachep->isolate || !cachep->migrate) return 0;
+    LOCK(&CriticalSection, LOCK_OTHER);
+    if (!defer_try_lock()) { UNLOCK(&CriticalSection); return 0; } // a retire is in progress, pending frees cannot be checked
+    // sparse slabs are taken off the partial lists, so objects only move into fuller slabs
+    slab* sparse = cachep->partial[0];
+    cachep->partial[0] = 0;
+    unsigned room = 0;
+    for (int i = 1; i < PARTIAL_BUCKETS; i++) room += free_slots(cachep, cachep->partial[i]);
+    while (sparse) {
+        // emptiest sparse slab is drained, fullest ones become targets when fuller slabs run out
+        slab* src = sparse;
+        for (slab* ss = sparse; ss; ss = ss->next) {
+            if (ss->numAllocated < src->numAllocated) src = ss;
         }
-        currSlab->next = cachep->empty;
-        cachep->empty = currSlab;
-        if (!((cachep->flag >> 1) & 1)) cachep->flag |= 2;
-        if ((cachep->flag >> 1) != 3) {
-            kmem_cache_shrink(cachep);
+        slab_unlink(&sparse, src);
+        while (room < src->numAllocated && sparse) {
+            slab* target = sparse;
+            for (slab* ss = sparse; ss; ss = ss->next) {
+                if (ss->numAllocated > target->numAllocated) target = ss;
+            }
+            slab_unlink(&sparse, target);
+            room += cachep->object_num - target->numAllocated;
+            slab_relink(cachep, target);
         }
+        if (room < src->numAllocated) { slab_relink(cachep, src); break; }
+        room -= src->numAllocated;
+        if (!drain_slab(cachep, src)) room += src->numAllocated; // objects left behind did not use their room
+        slab_relink(cachep, src); // on empty list if every object moved
     }
-    LeaveCriticalSection(&CriticalSection);
-} // Deallocate one small memory buffer
+    while (sparse) {
+        slab* next = sparse->next;
+        slab_relink(cachep, sparse);
+        sparse = next;
+    }
+    defer_unlock();
+    int numBlocks = kmem_cache_shrink(cachep);
+    UNLOCK(&CriticalSection);
+    return numBlocks;
+} // Move objects out of sparse slabs and release emptied slabs
 
 void dealloc_slab(kmem_cache_t* cachep, slab* currSlab) {
     while (currSlab) {
         slab* next = currSlab->next;
+        set_owner(cachep, currSlab, 0);
         if (cachep->flag & 1) {
-            dealloc(currSlab->firstObj, cachep->slab_size); 
+            dealloc_blocks(currSlab->firstObj, cachep->slab_size); 
             kmem_cache_free(s.off_slab_cache, currSlab);
         } else {
-            dealloc(currSlab, cachep->slab_size);
+            dealloc_blocks(currSlab, cachep->slab_size);
         }
         currSlab = next;
     }
@@ -509,7 +837,10 @@ void dealloc_slab(kmem_cache_t* cachep, slab* currSlab) {
 
 void kmem_cache_destroy(kmem_cache_t* cachep) {
     if (cachep == 0) return;
-    EnterCriticalSection(&CriticalSection);
+    // its descriptor may be reused by the next create, pending frees must not reach that cache;
+    // defer lock is taken before the allocator lock everywhere else
+    defer_forget_cache(cachep);
+    LOCK(&CriticalSection, LOCK_CACHE_DESTROY);
     cacheBlock* cb = s.firstCacheBlock;
     cacheBlock* prevCb = 0;
     while (cb) {
@@ -519,11 +850,22 @@ void kmem_cache_destroy(kmem_cache_t* cachep) {
         prevCb = cb;
         cb = cb->next;
     }
-    if (cb == 0) { printf("ERROR: Cache not found\n"); LeaveCriticalSection(&CriticalSection); return; }
+    if (cb == 0) { printf("ERROR: Cache not found\n"); UNLOCK(&CriticalSection); return; }
 
+    // unlink from list of caches in use
+    if (s.firstCache == cachep) s.firstCache = cachep->next;
+    else {
+        kmem_cache_t* prev = s.firstCache;
+        for (; prev && prev->next != cachep; prev = prev->next);
+        if (prev) prev->next = cachep->next;
+    }
+
+    if (prof_live) prof_forget_cache(cachep);
     // deallocate slabs
     if (cachep->empty) dealloc_slab(cachep, cachep->empty); 
-    if (cachep->partial) dealloc_slab(cachep, cachep->partial);
+    for (int i = 0; i < PARTIAL_BUCKETS; i++) {
+        if (cachep->partial[i]) dealloc_slab(cachep, cachep->partial[i]);
+    }
     if (cachep->full) dealloc_slab(cachep, cachep->full);
 
     // deallocate cache
@@ -539,15 +881,15 @@ void kmem_cache_destroy(kmem_cache_t* cachep) {
             prevCb->next = cb->next;
         }
         s.cache_block_num--;
-        dealloc(cb, 1); 
+        dealloc_blocks(cb, 1); 
     }
-    LeaveCriticalSection(&CriticalSection);
+    UNLOCK(&CriticalSection);
 } 
 
 
 
 void kmem_cache_info(kmem_cache_t* cachep) {
-    EnterCriticalSection(&CriticalSection);
+    LOCK(&CriticalSection, LOCK_OTHER);
     printf("--- cache info ---\n");
     printf("name: %s\n", cachep->name);
     //
@@ -557,14 +899,85 @@ void kmem_cache_info(kmem_cache_t* cachep) {
     printf("cache size: %luB\n", cachep->slab_num*cachep->slab_size*BLOCK_SIZE);
     printf("slab num: %d\n", cachep->slab_num);
     printf("num objects/slab: %d\n", cachep->object_num);
+    if (cachep->reserved) printf("reserved objects: %u\n", cachep->reserved);
     double usage = calcUsage(cachep);
     printf("cache usage: %.3lf%% \n", usage);
+    printf("partial slabs by occupancy:");
+    for (int i = 0; i < PARTIAL_BUCKETS; i++) {
+        int n = 0;
+        for (slab* ss = cachep->partial[i]; ss; ss = ss->next) n++;
+        printf(" %d", n);
+    }
+    printf("\n");
+    printf("allocation failures: %u\n", cachep->alloc_failures);
     printf("-----------------\n");
-    LeaveCriticalSection(&CriticalSection);
+    UNLOCK(&CriticalSection);
 } // Print cache info
 
+unsigned kmem_cache_slabs(kmem_cache_t* cachep) {
+    if (cachep == 0) return 0;
+    LOCK(&CriticalSection, LOCK_OTHER);
+    unsigned num = cachep->slab_num;
+    UNLOCK(&CriticalSection);
+    return num;
+} // Number of slabs in cache
+
+void kmem_free_area(struct buddy_info* info) {
+    LOCK(&CriticalSection, LOCK_OTHER);
+    buddy_snapshot(info);
+    UNLOCK(&CriticalSection);
+} // Snapshot of free blocks per order
+
+void kmem_free_area_info() {
+    LOCK(&CriticalSection, LOCK_OTHER);
+    print_free_area();
+    UNLOCK(&CriticalSection);
+} // Print free area and fragmentation report
+
+int kmem_profile_start(unsigned sample_bytes) {
+    LOCK(&CriticalSection, LOCK_OTHER);
+    int ret = prof_start(sample_bytes);
+    UNLOCK(&CriticalSection);
+    return ret;
+} // Start sampling allocations
+
+void kmem_profile_stop() {
+    LOCK(&CriticalSection, LOCK_OTHER);
+    prof_stop();
+    UNLOCK(&CriticalSection);
+} // Stop sampling and drop samples
+
+void kmem_profile_dump() {
+    LOCK(&CriticalSection, LOCK_OTHER);
+    prof_dump();
+    UNLOCK(&CriticalSection);
+} // Print sampled live heap and allocation rate by stack
+
+void kmem_lock_stats(struct kmem_lock_stat_s* stats) {
+    LOCK(&CriticalSection, LOCK_OTHER);
+    lock_stats_copy(stats);
+    UNLOCK(&CriticalSection);
+} // Copy lock statistics, one entry per entry point
+
+void kmem_lock_stats_reset() {
+    LOCK(&CriticalSection, LOCK_OTHER);
+    lock_stats_reset();
+    UNLOCK(&CriticalSection);
+} // Clear lock statistics
+
+void kmem_lock_stats_info() {
+    LOCK(&CriticalSection, LOCK_OTHER);
+#ifdef KMEM_LOCK_STATS
+    lock_stats_print();
+#else
+    printf("Lock statistics are disabled, build with KMEM_LOCK_STATS.\n");
+#endif
+    UNLOCK(&CriticalSection);
+} // Print lock statistics
+
 int kmem_cache_error(kmem_cache_t* cachep) {
     // 1 : cache name overflow
+    // 2 : out of memory, even after reclaim
     return cachep->error;
 } // Print error message
 
@@ -5,6 +5,7 @@
 typedef struct kmem_cache_s kmem_cache_t;
 #define BLOCK_SIZE (4096)
 #define CACHE_L1_LINE_SIZE (64)
+#define KMALLOC_MAX (32 << 12) // largest size-N cache
 
 void kmem_init(void* space, int block_num);
 
@@ -12,6 +13,21 @@ kmem_cache_t* kmem_cache_create(const char* name, size_t size, void (*ctor)(void
 
 int kmem_cache_shrink(kmem_cache_t* cachep); // Shrink cache
 
+// slabs for n_objects are built in one pass and shrink keeps them until kmem_cache_unreserve; -1 if memory ran out
+int kmem_cache_reserve(kmem_cache_t* cachep, unsigned n_objects); // Grow cache to hold n_objects and keep them from shrink
+
+void kmem_cache_unreserve(kmem_cache_t* cachep); // Let shrink release reserved slabs again
+
+// isolate returns nonzero if obj may be moved now and keeps its owner away from it; migrate is called
+// after obj was copied to its new address, it updates references and releases obj.
+// Both run under the allocator lock and must not call the allocator. Slabs holding an object with a pending
+// deferred free are not drained, and defrag returns 0 without moving anything while a deferred free is being queued.
+void kmem_cache_set_relocate(kmem_cache_t* cachep, int (*isolate)(void *), void (*migrate)(void *, void *)); // Register object relocation callbacks
+
+int kmem_cache_defrag(kmem_cache_t* cachep); // Move objects out of sparse slabs and release emptied slabs, returns number of released blocks
+
+kmem_cache_t* kmem_cache_create_reserved(const char* name, size_t size, void (*ctor)(void *), void (*dtor)(void *), unsigned min_objects); // Allocate cache with min_objects reserved
+
 void* kmem_cache_alloc(kmem_cache_t* cachep); // Allocate one object from cache
 
 void kmem_cache_free(kmem_cache_t* cachep, void* objp); // Deallocate one object from cache
@@ -20,10 +36,63 @@ void* kmalloc(size_t size); // Allocate one small memmory buffer
 
 void kfree(const void* objp); // Deallocate one small memory buffer
 
+// faster when objects of one slab are next to each other in objs, e.g. sorted by address
+void kmem_cache_free_bulk(kmem_cache_t* cachep, void** objs, unsigned n); // Deallocate n objects from cache
+
+void kfree_bulk(void** objs, unsigned n); // Deallocate n small memory buffers
+
+size_t ksize(const void* objp); // Usable size of a small memory buffer, 0 if it is not one
+
+// pending deferred frees of its objects are dropped, readers must not see them anymore
 void kmem_cache_destroy(kmem_cache_t* cachep); // Deallocate cache
 
 void kmem_cache_info(kmem_cache_t* cachep); // Print cache info
 
+unsigned kmem_cache_slabs(kmem_cache_t* cachep); // Number of slabs in cache
+
 int kmem_cache_error(kmem_cache_t* cachep); // Print error message
 
+// shrinker returns number of blocks it released; it runs under the allocator lock and must not allocate
+int kmem_register_shrinker(int (*shrinker)(void *), void* arg); // Register reclaim callback
+
+void kmem_unregister_shrinker(int (*shrinker)(void *), void* arg); // Remove reclaim callback
+
+int kmem_reclaim(); // Shrink every cache and run shrinkers, returns number of released blocks
+
+struct buddy_info; // buddy.h
+
+void kmem_free_area(struct buddy_info* info); // Snapshot of free blocks per order, drains per-cpu block lists first
+
+void kmem_free_area_info(); // Print free area and fragmentation report
+
+// samples one allocation per sample_bytes on average (0 for default), backtrace kept until object is freed
+int kmem_profile_start(unsigned sample_bytes); // Start sampling allocations
+
+void kmem_profile_stop(); // Stop sampling and drop samples
+
+void kmem_profile_dump(); // Print sampled live heap and allocation rate by stack
+
+struct kmem_lock_stat_s; // lockstat.h, collected only when built with KMEM_LOCK_STATS
+
+void kmem_lock_stats(struct kmem_lock_stat_s* stats); // Copy lock statistics, one entry per entry point
+
+void kmem_lock_stats_reset(); // Clear lock statistics
+
+void kmem_lock_stats_info(); // Print lock statistics
+
+// epoch based deferred free: objects retired while a read-side section may still see them
+// are freed once every reader that was inside at retire time has left
+int kmem_read_lock(); // Enter read-side section, returns token for kmem_read_unlock
+
+void kmem_read_unlock(int token); // Leave read-side section
+
+// -1 if there was no memory to queue the object, it is still allocated and stays with the caller
+int kmem_cache_free_deferred(kmem_cache_t* cachep, void* objp); // Free object after a grace period
+
+int kfree_deferred(const void* objp); // Free small memory buffer after a grace period, -1 if it was not queued
+
+int kmem_defer_poll(); // Free objects whose grace period has passed, returns number of freed objects
+
+void kmem_defer_barrier(); // Wait until every deferred object is freed, not from a read-side section
+
 #endif
\ No newline at end of file
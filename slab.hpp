@@ -0,0 +1,105 @@
+#ifndef _SLAB_HPP
+#define _SLAB_HPP
+// C++ layer over slab.h: typed object caches and an STL allocator
+extern "C" {
+#include "slab.h"
+}
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <new>
+#include <utility>
+
+namespace kmem {
+
+// cache of T objects; create() runs T's constructor on a slot, destroy() runs the destructor and frees the slot
+template <class T>
+class object_cache {
+public:
+    explicit object_cache(const char* name) : cache(kmem_cache_create(name, sizeof(T), 0, 0)) {
+        if (!cache) throw std::bad_alloc();
+    }
+    ~object_cache() { kmem_cache_destroy(cache); }
+
+    object_cache(const object_cache&) = delete;
+    object_cache& operator=(const object_cache&) = delete;
+
+    template <class... Args>
+    T* create(Args&&... args) {
+        void* p = kmem_cache_alloc(cache);
+        if (!p) throw std::bad_alloc();
+        try {
+            return new (p) T(std::forward<Args>(args)...);
+        } catch (...) {
+            kmem_cache_free(cache, p);
+            throw;
+        }
+    }
+
+    void destroy(T* obj) {
+        if (!obj) return;
+        obj->~T();
+        kmem_cache_free(cache, obj);
+    }
+
+    kmem_cache_t* get() const { return cache; }
+
+private:
+    kmem_cache_t* cache;
+};
+
+// one cache per node type, created on first use and kept for the lifetime of the program;
+// a failed create is tried again on the next call, a thread that loses the race destroys its copy
+template <class T>
+kmem_cache_t* node_cache() {
+    static std::atomic<kmem_cache_t*> cache(nullptr);
+    kmem_cache_t* curr = cache.load(std::memory_order_acquire);
+    if (curr) return curr;
+    char name[20];
+    std::snprintf(name, sizeof(name), "stl-%lu", (unsigned long)sizeof(T));
+    kmem_cache_t* created = kmem_cache_create(name, sizeof(T), 0, 0);
+    if (!created) return 0;
+    if (!cache.compare_exchange_strong(curr, created, std::memory_order_acq_rel)) {
+        kmem_cache_destroy(created);
+        return curr;
+    }
+    return created;
+}
+
+// std::allocator replacement: single objects (list/map/unordered_map nodes) come from node_cache<T>,
+// arrays (vector storage, hash buckets) from kmalloc
+template <class T>
+class allocator {
+public:
+    typedef T value_type;
+
+    allocator() noexcept {}
+    template <class U>
+    allocator(const allocator<U>&) noexcept {}
+
+    T* allocate(std::size_t n) {
+        void* p = 0;
+        if (n == 1) p = kmem_cache_alloc(node_cache<T>());
+        else if (n <= KMALLOC_MAX / sizeof(T)) p = kmalloc(n * sizeof(T));
+        if (!p) throw std::bad_alloc();
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept {
+        if (n == 1) kmem_cache_free(node_cache<T>(), p);
+        else kfree(p);
+    }
+
+    template <class U>
+    struct rebind { typedef allocator<U> other; };
+};
+
+template <class T, class U>
+bool operator==(const allocator<T>&, const allocator<U>&) noexcept { return true; }
+
+template <class T, class U>
+bool operator!=(const allocator<T>&, const allocator<U>&) noexcept { return false; }
+
+} // namespace kmem
+
+#endif